@@ -1,337 +1,6391 @@
 // SoftPT.cpp
 
 #define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
 #include <Windows.h>
 #include <vector>
+#include <cmath>
+#include <type_traits>
 #include <cassert>
 #include <array>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <functional>
+#include <cstdio>
+#include <cwchar>
+#include <string>
+#include <map>
+#include <memory>
+#include <variant>
+#include <io.h>
+#include <fcntl.h>
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif//__AVX2__
 
 #define USE_SKY_COLOR 0
+#define ANIMATE_CAMERA 0
+#define USE_MEDIA 0
+#define USE_SPECULAR_MATERIALS 0
+#define USE_TEXTURES 0
+#define USE_PROCEDURAL_TEXTURES 0
+// Normalize and Camera::GenerateRays with the rsqrt estimate instead of sqrt and a division. Not a win on current
+// cores: --selftest times both forms slower than sqrt, while the image changes by under 1e-6 RMS. Kept for targets
+// where sqrt and division are slow.
+#define USE_FAST_RSQRT 0
+#define USE_DOUBLE_GEOMETRY 0
 
 const float kPi = 3.1415927f;
 const float kEpsilon = 0.00001f;
 
-class Vector3
+// 1 / sqrt(value) from the hardware estimate and one Newton-Raphson step, for positive normal floats. The estimate is
+// good to 12 bits; after the step the relative error stays below 4e-7 (2.9e-7 measured), against 1.2e-7 for the exact
+// sqrt and division. Used by Normalize when USE_FAST_RSQRT is set.
+float ReciprocalSqrt(float value)
+{
+    const float estimate = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(value)));
+    return estimate * (1.5f - 0.5f * value * estimate * estimate);
+}
+
+// Three-component vector. Vector3 (float) is used throughout; Vector3d holds world positions and the double precision
+// ray-sphere solve.
+template< typename T >
+class Vector3T
 {
 public:
-    Vector3() = default;
-    Vector3(const Vector3& rhs) = default;
-    explicit Vector3(float in)
+    Vector3T() = default;
+    Vector3T(const Vector3T& rhs) = default;
+    explicit Vector3T(T in)
         : x(in)
         , y(in)
         , z(in)
     {}
-    Vector3(float inX, float inY, float inZ)
+    template< typename U >
+    explicit Vector3T(const Vector3T<U>& rhs)
+        : x(static_cast<T>(rhs.x))
+        , y(static_cast<T>(rhs.y))
+        , z(static_cast<T>(rhs.z))
+    {}
+    Vector3T(T inX, T inY, T inZ)
         : x(inX)
         , y(inY)
         , z(inZ)
     {}
 
-    float Dot(const Vector3& rhs) const
+    T Dot(const Vector3T& rhs) const
     {
         return x * rhs.x + y * rhs.y + z * rhs.z;
     }
 
-    Vector3 Cross(const Vector3& rhs) const
+    Vector3T Cross(const Vector3T& rhs) const
     {
-        return Vector3{y * rhs.z - z * rhs.y, z * rhs.x - x * rhs.z, x * rhs.y - y * rhs.x};
+        return Vector3T{y * rhs.z - z * rhs.y, z * rhs.x - x * rhs.z, x * rhs.y - y * rhs.x};
     }
 
-    float Length() const
+    T Length() const
     {
-        return sqrtf(Dot(*this));
+        return std::sqrt(Dot(*this));
     }
 
-    Vector3 operator-(const Vector3& rhs) const
+    Vector3T operator-(const Vector3T& rhs) const
     {
         return { x - rhs.x, y - rhs.y, z - rhs.z };
     }
 
-    Vector3 operator+(const Vector3& rhs) const
+    Vector3T operator+(const Vector3T& rhs) const
     {
         return { x + rhs.x, y + rhs.y, z + rhs.z };
     }
 
-    Vector3 operator*(const Vector3& rhs) const
-    {
-        return { x * rhs.x, y * rhs.y, z * rhs.z };
-    }
+    Vector3T operator*(const Vector3T& rhs) const
+    {
+        return { x * rhs.x, y * rhs.y, z * rhs.z };
+    }
+
+    Vector3T operator*(T rhs) const
+    {
+        return { x * rhs, y * rhs, z * rhs };
+    }
+
+    Vector3T operator+(T rhs) const
+    {
+        return { x + rhs, y + rhs, z + rhs };
+    }
+
+    Vector3T Normalize() const
+    {
+        #if USE_FAST_RSQRT == 1
+        if constexpr (std::is_same_v<T, float>)
+        {
+            return *this * ReciprocalSqrt(Dot(*this));
+        }
+        else
+        {
+            return *this * (static_cast<T>(1) / Length());
+        }
+        #else
+        return *this * (static_cast<T>(1) / Length());
+        #endif
+    }
+
+    T Distance(const Vector3T& rhs) const
+    {
+        return (*this - rhs).Length();
+    }
+
+    bool IsEquivalent(const Vector3T& rhs, const T maxDelta = kEpsilon) const
+    {
+        Vector3T delta = rhs - *this;
+        return delta.Length() < maxDelta;
+    }
+
+    Vector3T ComponentMin(const Vector3T& rhs) const
+    {
+        return { x < rhs.x ? x : rhs.x, y < rhs.y ? y : rhs.y, z < rhs.z ? z : rhs.z };
+    }
+
+    Vector3T ComponentMax(const Vector3T& rhs) const
+    {
+        return { x > rhs.x ? x : rhs.x, y > rhs.y ? y : rhs.y, z > rhs.z ? z : rhs.z };
+    }
+
+    T x;
+    T y;
+    T z;
+};
+
+using Vector3 = Vector3T<float>;
+using Vector3d = Vector3T<double>;
+
+// Scalar type of the intersection arithmetic. Scene data and shading stay in float either way, relative to the scene's
+// origin; USE_DOUBLE_GEOMETRY only widens the ray-sphere solve, whose results are rounded back to float once.
+#if USE_DOUBLE_GEOMETRY == 1
+using GeometryReal = double;
+#else
+using GeometryReal = float;
+#endif//USE_DOUBLE_GEOMETRY
+
+class Ray
+{
+public:
+    Vector3 origin;
+    Vector3 direction;
+    float   time = 0.0f;       // Position within the shutter interval, [0, 1)
+    float   coneWidth = 0.0f;  // Ray cone approximating the ray's differentials: footprint width at the origin
+    float   coneSpread = 0.0f; // and its growth per unit distance, used to pick texture mip levels
+};
+
+template< typename T >
+T Lerp(T val0, T val1, float t)
+{
+    return val0 + (val1 - val0) * t;
+}
+
+float Saturate(float in)
+{
+    return in < 0.0f ? 0.0f : in > 1.0f ? 1.0f : in;
+}
+
+float Max(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+float Luminance(const Vector3& color)
+{
+    return color.x * 0.2126f + color.y * 0.7152f + color.z * 0.0722f;
+}
+
+uint32_t HashUint(uint32_t value)
+{
+    value ^= value >> 16;
+    value *= 0x7feb352dU;
+    value ^= value >> 15;
+    value *= 0x846ca68bU;
+    value ^= value >> 16;
+    return value;
+}
+
+// Small xorshift generator; each worker owns one so sampling needs no shared state
+class Random
+{
+public:
+    explicit Random(uint32_t seed)
+        : state(HashUint(seed) | 1U)
+    {}
+
+    uint32_t NextUint()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    // Uniform in [0, 1)
+    float NextFloat()
+    {
+        return static_cast<float>(NextUint() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    uint32_t state;
+};
+
+// Eight xoshiro128+ streams advanced in lockstep, one per SIMD lane, for code that samples a whole batch of rays at
+// once. With AVX2 a step of all eight lanes is a handful of instructions; otherwise two SSE2 halves take the same
+// steps, so both builds produce the same numbers. Every state word of every lane is seeded separately through
+// HashUint.
+class RandomLanes
+{
+public:
+    static const int kNumLanes = 8;
+
+    explicit RandomLanes(uint32_t seed)
+    {
+        for (int word = 0; word < 4; ++word)
+        {
+            for (int lane = 0; lane < kNumLanes; ++lane)
+            {
+                state[word][lane] = HashUint(seed ^ HashUint(static_cast<uint32_t>(word * kNumLanes + lane)));
+            }
+        }
+
+        // An all-zero state would stay zero
+        for (int lane = 0; lane < kNumLanes; ++lane)
+        {
+            state[0][lane] |= 1U;
+        }
+    }
+
+    // Writes count uniform numbers in [0, 1), taking lane i's next number for out[step * kNumLanes + i]. Numbers past
+    // count in the last step are discarded. Runs Fillx8 when built with AVX2 (the SOFTPT_AVX2 CMake option) and Fillx4
+    // otherwise; Fillx4 is always built so that --selftest can compare the two.
+    void Fill(float* out, int count)
+    {
+        #if defined(__AVX2__)
+        Fillx8(out, count);
+        #else
+        Fillx4(out, count);
+        #endif//__AVX2__
+    }
+
+    void Fillx4(float* out, int count)
+    {
+        alignas(32) float tail[kNumLanes];
+        for (int half = 0; half < kNumLanes; half += 4)
+        {
+            __m128i s0 = _mm_load_si128(reinterpret_cast<const __m128i*>(state[0] + half));
+            __m128i s1 = _mm_load_si128(reinterpret_cast<const __m128i*>(state[1] + half));
+            __m128i s2 = _mm_load_si128(reinterpret_cast<const __m128i*>(state[2] + half));
+            __m128i s3 = _mm_load_si128(reinterpret_cast<const __m128i*>(state[3] + half));
+            for (int i = 0; i < count; i += kNumLanes)
+            {
+                const __m128i result = _mm_add_epi32(s0, s3);
+                const __m128i t = _mm_slli_epi32(s1, 9);
+                s2 = _mm_xor_si128(s2, s0);
+                s3 = _mm_xor_si128(s3, s1);
+                s1 = _mm_xor_si128(s1, s2);
+                s0 = _mm_xor_si128(s0, s3);
+                s2 = _mm_xor_si128(s2, t);
+                s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+
+                // Top 24 bits, which are the well-distributed ones for the + scrambler
+                const __m128 value = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(result, 8)), _mm_set1_ps(1.0f / 16777216.0f));
+                _mm_storeu_ps(i + kNumLanes <= count ? out + i + half : tail + half, value);
+            }
+            _mm_store_si128(reinterpret_cast<__m128i*>(state[0] + half), s0);
+            _mm_store_si128(reinterpret_cast<__m128i*>(state[1] + half), s1);
+            _mm_store_si128(reinterpret_cast<__m128i*>(state[2] + half), s2);
+            _mm_store_si128(reinterpret_cast<__m128i*>(state[3] + half), s3);
+        }
+
+        const int remainder = count % kNumLanes;
+        for (int i = 0; i < remainder; ++i)
+        {
+            out[count - remainder + i] = tail[i];
+        }
+    }
+
+    #if defined(__AVX2__)
+    void Fillx8(float* out, int count)
+    {
+        alignas(32) float tail[kNumLanes];
+        __m256i s0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[0]));
+        __m256i s1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[1]));
+        __m256i s2 = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[2]));
+        __m256i s3 = _mm256_load_si256(reinterpret_cast<const __m256i*>(state[3]));
+        for (int i = 0; i < count; i += kNumLanes)
+        {
+            const __m256i result = _mm256_add_epi32(s0, s3);
+            const __m256i t = _mm256_slli_epi32(s1, 9);
+            s2 = _mm256_xor_si256(s2, s0);
+            s3 = _mm256_xor_si256(s3, s1);
+            s1 = _mm256_xor_si256(s1, s2);
+            s0 = _mm256_xor_si256(s0, s3);
+            s2 = _mm256_xor_si256(s2, t);
+            s3 = _mm256_or_si256(_mm256_slli_epi32(s3, 11), _mm256_srli_epi32(s3, 21));
+
+            // Top 24 bits, which are the well-distributed ones for the + scrambler
+            const __m256 value = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(result, 8)), _mm256_set1_ps(1.0f / 16777216.0f));
+            _mm256_storeu_ps(i + kNumLanes <= count ? out + i : tail, value);
+        }
+        _mm256_store_si256(reinterpret_cast<__m256i*>(state[0]), s0);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(state[1]), s1);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(state[2]), s2);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(state[3]), s3);
+
+        const int remainder = count % kNumLanes;
+        for (int i = 0; i < remainder; ++i)
+        {
+            out[count - remainder + i] = tail[i];
+        }
+    }
+
+    #endif//__AVX2__
+
+    alignas(32) uint32_t state[4][kNumLanes]; // Word-major, so each word of all lanes loads as one vector
+};
+
+float SrgbToLinear(float value)
+{
+    return value <= 0.04045f ? value * (1.0f / 12.92f) : powf((value + 0.055f) * (1.0f / 1.055f), 2.4f);
+}
+
+float LinearToSrgb(float value)
+{
+    return value <= 0.0031308f ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+}
+
+// Image texture with 8-bit sRGB texels and a full box-filtered mip chain. Every level is stored as square tiles of
+// kTileSize x kTileSize texels, so a bilinear footprint touches at most four small contiguous blocks instead of rows
+// a whole image width apart. Textures are immutable once built and are shared between scenes.
+class Texture
+{
+public:
+    static const int kTileShift = 3;
+    static const int kTileSize = 1 << kTileShift;
+    static const int kTileTexels = kTileSize * kTileSize;
+
+    class Level
+    {
+    public:
+        int    width;
+        int    height;
+        int    tilesX;
+        int    tilesY;
+        size_t firstTexel; // Offset of the level's first tile in texels
+    };
+
+    // Texels are 0x00RRGGBB, top row first, like the display buffer
+    Texture(int width, int height, const uint32_t* texels)
+    {
+        static std::atomic<uint32_t> nextId{ 0 };
+        id = nextId++;
+
+        // Mips are filtered in linear space and re-encoded
+        std::vector<Vector3> linear(static_cast<size_t>(width) * height);
+        for (size_t i = 0; i < linear.size(); ++i)
+        {
+            linear[i] = DecodeTexel(texels[i]);
+        }
+
+        for (;;)
+        {
+            AddLevel(width, height, linear);
+            if (width == 1 && height == 1)
+            {
+                break;
+            }
+
+            // 2x2 box filter; for odd sizes the last row or column is dropped
+            const int nextWidth = std::max(width / 2, 1);
+            const int nextHeight = std::max(height / 2, 1);
+            std::vector<Vector3> next(static_cast<size_t>(nextWidth) * nextHeight);
+            for (int y = 0; y < nextHeight; ++y)
+            {
+                for (int x = 0; x < nextWidth; ++x)
+                {
+                    const int x0 = std::min(2 * x, width - 1);
+                    const int x1 = std::min(2 * x + 1, width - 1);
+                    const int y0 = std::min(2 * y, height - 1);
+                    const int y1 = std::min(2 * y + 1, height - 1);
+                    next[y * nextWidth + x] = (linear[y0 * width + x0] + linear[y0 * width + x1] + linear[y1 * width + x0] + linear[y1 * width + x1]) * 0.25f;
+                }
+            }
+
+            width = nextWidth;
+            height = nextHeight;
+            linear = std::move(next);
+        }
+    }
+
+    static Vector3 DecodeTexel(uint32_t texel)
+    {
+        const float* table = SrgbTable();
+        return Vector3{ table[(texel >> 16) & 0xff], table[(texel >> 8) & 0xff], table[texel & 0xff] };
+    }
+
+    // Pointer to the kTileTexels texels of a tile, row by row
+    const uint32_t* Tile(int level, int tileX, int tileY) const
+    {
+        const Level& l = levels[level];
+        return texels.data() + l.firstTexel + static_cast<size_t>(tileY * l.tilesX + tileX) * kTileTexels;
+    }
+
+    int NumLevels() const
+    {
+        return static_cast<int>(levels.size());
+    }
+
+    uint32_t           id; // Unique per texture, identifies its tiles in texture caches
+    std::vector<Level> levels;
+
+private:
+    static const float* SrgbTable()
+    {
+        static const std::array<float, 256> table = []()
+        {
+            std::array<float, 256> result;
+            for (int i = 0; i < 256; ++i)
+            {
+                result[i] = SrgbToLinear(static_cast<float>(i) * (1.0f / 255.0f));
+            }
+            return result;
+        }();
+        return table.data();
+    }
+
+    void AddLevel(int width, int height, const std::vector<Vector3>& linear)
+    {
+        Level level{ width, height, (width + kTileSize - 1) >> kTileShift, (height + kTileSize - 1) >> kTileShift, texels.size() };
+        levels.push_back(level);
+
+        // Texels of partial edge tiles past the level's size are never sampled and stay zero
+        texels.resize(texels.size() + static_cast<size_t>(level.tilesX) * level.tilesY * kTileTexels, 0);
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                const Vector3& color = linear[y * width + x];
+                const uint32_t r = static_cast<uint32_t>(LinearToSrgb(Saturate(color.x)) * 255.0f + 0.5f);
+                const uint32_t g = static_cast<uint32_t>(LinearToSrgb(Saturate(color.y)) * 255.0f + 0.5f);
+                const uint32_t b = static_cast<uint32_t>(LinearToSrgb(Saturate(color.z)) * 255.0f + 0.5f);
+                const size_t tile = static_cast<size_t>((y >> kTileShift) * level.tilesX + (x >> kTileShift));
+                const size_t offset = ((y & (kTileSize - 1)) << kTileShift) + (x & (kTileSize - 1));
+                texels[level.firstTexel + tile * kTileTexels + offset] = (r << 16) | (g << 8) | b;
+            }
+        }
+    }
+
+    std::vector<uint32_t> texels; // Tiles of all levels, finest first
+};
+
+// Bounded cache of decoded texture tiles, one per thread so lookups need no synchronization. Tiles are converted from
+// sRGB bytes to linear floats once per fill; the fixed, direct-mapped set of entries bounds each thread's working set
+// however many textures a scene uses, so it stays cache resident instead of streaming texels from memory.
+class TextureCache
+{
+public:
+    static const int kNumEntries = 256;                    // Power of two; 192 KiB of decoded texels
+    static const int kTileFloats = Texture::kTileTexels * 3;
+
+    TextureCache()
+        : keys(kNumEntries, UINT64_MAX)
+        , tiles(static_cast<size_t>(kNumEntries) * kTileFloats)
+    {}
+
+    static TextureCache& ForThread()
+    {
+        thread_local TextureCache cache;
+        return cache;
+    }
+
+    // Linear RGB of a tile, kTileFloats floats row by row
+    const float* Lookup(const Texture& texture, int level, int tileX, int tileY)
+    {
+        const uint32_t tileIndex = static_cast<uint32_t>(tileY * texture.levels[level].tilesX + tileX);
+        const uint64_t key = (static_cast<uint64_t>(texture.id) << 32) | (static_cast<uint64_t>(level) << 27) | tileIndex;
+        const uint32_t entry = HashUint(static_cast<uint32_t>(key) ^ HashUint(texture.id)) & (kNumEntries - 1);
+        float* tile = tiles.data() + static_cast<size_t>(entry) * kTileFloats;
+        if (keys[entry] != key)
+        {
+            const uint32_t* texels = texture.Tile(level, tileX, tileY);
+            for (int i = 0; i < Texture::kTileTexels; ++i)
+            {
+                Vector3 color = Texture::DecodeTexel(texels[i]);
+                tile[3 * i + 0] = color.x;
+                tile[3 * i + 1] = color.y;
+                tile[3 * i + 2] = color.z;
+            }
+            keys[entry] = key;
+        }
+        return tile;
+    }
+
+private:
+    std::vector<uint64_t> keys;
+    std::vector<float>    tiles;
+};
+
+// Trilinear lookup. u wraps and v clamps; lod is the mip level, with fractional values blending neighbouring levels.
+Vector3 SampleTexture(const Texture& texture, float u, float v, float lod, TextureCache& cache)
+{
+    auto bilinear = [&](int level)
+    {
+        const Texture::Level& l = texture.levels[level];
+        const float x = (u - floorf(u)) * static_cast<float>(l.width) - 0.5f;
+        const float y = Saturate(v) * static_cast<float>(l.height) - 0.5f;
+        const float floorX = floorf(x);
+        const float floorY = floorf(y);
+        const float fracX = x - floorX;
+        const float fracY = y - floorY;
+        const int x0 = (static_cast<int>(floorX) + l.width) % l.width;
+        const int x1 = (x0 + 1) % l.width;
+        const int y0 = std::max(static_cast<int>(floorY), 0);
+        const int y1 = std::min(static_cast<int>(floorY) + 1, l.height - 1);
+
+        auto fetch = [&](int tx, int ty)
+        {
+            const float* tile = cache.Lookup(texture, level, tx >> Texture::kTileShift, ty >> Texture::kTileShift);
+            const float* texel = tile + 3 * (((ty & (Texture::kTileSize - 1)) << Texture::kTileShift) + (tx & (Texture::kTileSize - 1)));
+            return Vector3{ texel[0], texel[1], texel[2] };
+        };
+
+        return Lerp(Lerp(fetch(x0, y0), fetch(x1, y0), fracX), Lerp(fetch(x0, y1), fetch(x1, y1), fracX), fracY);
+    };
+
+    const float maxLevel = static_cast<float>(texture.NumLevels() - 1);
+    lod = std::min(std::max(lod, 0.0f), maxLevel);
+    const int level = static_cast<int>(lod);
+    const float blend = lod - static_cast<float>(level);
+    if (blend == 0.0f)
+    {
+        return bilinear(level);
+    }
+    return Lerp(bilinear(level), bilinear(level + 1), blend);
+}
+
+// Four-wide building blocks for procedural patterns. SSE2 has no 32-bit low multiply or floor, so both are emulated.
+__m128i MulLo32x4(__m128i a, __m128i b)
+{
+    const __m128i even = _mm_mul_epu32(a, b);
+    const __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// Same values as HashUint in each lane
+__m128i HashUintx4(__m128i value)
+{
+    value = _mm_xor_si128(value, _mm_srli_epi32(value, 16));
+    value = MulLo32x4(value, _mm_set1_epi32(0x7feb352d));
+    value = _mm_xor_si128(value, _mm_srli_epi32(value, 15));
+    value = MulLo32x4(value, _mm_set1_epi32(static_cast<int>(0x846ca68bU)));
+    value = _mm_xor_si128(value, _mm_srli_epi32(value, 16));
+    return value;
+}
+
+__m128 Floorx4(__m128 value)
+{
+    const __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(value));
+    return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, value), _mm_set1_ps(1.0f)));
+}
+
+__m128 Selectx4(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+__m128 Lerpx4(__m128 a, __m128 b, __m128 t)
+{
+    return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), t));
+}
+
+// Same values as ReciprocalSqrt in each lane
+__m128 ReciprocalSqrtx4(__m128 value)
+{
+    const __m128 estimate = _mm_rsqrt_ps(value);
+    const __m128 correction = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), value), estimate), estimate);
+    return _mm_mul_ps(estimate, _mm_sub_ps(_mm_set1_ps(1.5f), correction));
+}
+
+// Sine and cosine of 2 * pi * turns for sampling angles. The nearest quarter turn is split off, which leaves an
+// angle within pi / 4 for the Taylor polynomials below; absolute error stays under 4e-7 for turns in [-1, 1]. The
+// scalar version evaluates the sine and cosine polynomials side by side in two lanes, the sine's with a leading zero
+// coefficient, and rotates by the quarter turns with masks rather than branches, since sampled angles make the
+// quadrant unpredictable. Both versions perform the same operations per value, so they return the same values.
+void SinCos2Pi(float turns, float& outSin, float& outCos)
+{
+    const float quarters = turns * 4.0f;
+    const int quadrant = _mm_cvtss_si32(_mm_set_ss(quarters));
+    const float angle = (quarters - static_cast<float>(quadrant)) * (0.5f * kPi);
+    const __m128 angleSq = _mm_set1_ps(angle * angle);
+    __m128 value = _mm_setr_ps(0.0f, 1.0f / 40320.0f, 0.0f, 0.0f);
+    value = _mm_add_ps(_mm_setr_ps(-1.0f / 5040.0f, -1.0f / 720.0f, 0.0f, 0.0f), _mm_mul_ps(angleSq, value));
+    value = _mm_add_ps(_mm_setr_ps(1.0f / 120.0f, 1.0f / 24.0f, 0.0f, 0.0f), _mm_mul_ps(angleSq, value));
+    value = _mm_add_ps(_mm_setr_ps(-1.0f / 6.0f, -0.5f, 0.0f, 0.0f), _mm_mul_ps(angleSq, value));
+    value = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(angleSq, value));
+    value = _mm_mul_ps(_mm_setr_ps(angle, 1.0f, 1.0f, 1.0f), value);
+
+    // Rotate by the quarter turns: odd ones swap sine and cosine, and the signs follow the quadrant
+    const __m128 swap = _mm_castsi128_ps(_mm_set1_epi32(-(quadrant & 1)));
+    const __m128 swapped = _mm_shuffle_ps(value, value, _MM_SHUFFLE(3, 2, 0, 1));
+    const __m128 signs = _mm_castsi128_ps(_mm_setr_epi32((quadrant & 2) << 30, ((quadrant + 1) & 2) << 30, 0, 0));
+    value = _mm_xor_ps(Selectx4(swap, swapped, value), signs);
+    outSin = _mm_cvtss_f32(value);
+    outCos = _mm_cvtss_f32(_mm_shuffle_ps(value, value, _MM_SHUFFLE(3, 2, 1, 1)));
+}
+
+void SinCos2Pix4(__m128 turns, __m128& outSin, __m128& outCos)
+{
+    const __m128 quarters = _mm_mul_ps(turns, _mm_set1_ps(4.0f));
+    const __m128i quadrantIndex = _mm_cvtps_epi32(quarters);
+    const __m128 angle = _mm_mul_ps(_mm_sub_ps(quarters, _mm_cvtepi32_ps(quadrantIndex)), _mm_set1_ps(0.5f * kPi));
+    const __m128 angleSq = _mm_mul_ps(angle, angle);
+    __m128 sinAngle = _mm_add_ps(_mm_set1_ps(1.0f / 120.0f), _mm_mul_ps(angleSq, _mm_set1_ps(-1.0f / 5040.0f)));
+    sinAngle = _mm_add_ps(_mm_set1_ps(-1.0f / 6.0f), _mm_mul_ps(angleSq, sinAngle));
+    sinAngle = _mm_mul_ps(angle, _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(angleSq, sinAngle)));
+    __m128 cosAngle = _mm_add_ps(_mm_set1_ps(-1.0f / 720.0f), _mm_mul_ps(angleSq, _mm_set1_ps(1.0f / 40320.0f)));
+    cosAngle = _mm_add_ps(_mm_set1_ps(1.0f / 24.0f), _mm_mul_ps(angleSq, cosAngle));
+    cosAngle = _mm_add_ps(_mm_set1_ps(-0.5f), _mm_mul_ps(angleSq, cosAngle));
+    cosAngle = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(angleSq, cosAngle));
+
+    const __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(quadrantIndex, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+    const __m128 sinSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(quadrantIndex, _mm_set1_epi32(2)), 30));
+    const __m128 cosSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(quadrantIndex, _mm_set1_epi32(1)), _mm_set1_epi32(2)), 30));
+    outSin = _mm_xor_ps(Selectx4(swap, cosAngle, sinAngle), sinSign);
+    outCos = _mm_xor_ps(Selectx4(swap, sinAngle, cosAngle), cosSign);
+}
+
+// Hash of integer lattice points, built up one axis at a time
+__m128i HashLatticex4(__m128i x, __m128i y, __m128i z)
+{
+    return HashUintx4(_mm_xor_si128(x, HashUintx4(_mm_xor_si128(y, HashUintx4(z)))));
+}
+
+// Dot product of the offset with one of Perlin's twelve edge gradients, picked by the low four bits of hash
+__m128 Gradientx4(__m128i hash, __m128 x, __m128 y, __m128 z)
+{
+    const __m128i h = _mm_and_si128(hash, _mm_set1_epi32(15));
+    const __m128 useX = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(8)));
+    const __m128 useY = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+    const __m128 useXForV = _mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(h, _mm_set1_epi32(12)), _mm_cmpeq_epi32(h, _mm_set1_epi32(14))));
+    const __m128 u = Selectx4(useX, x, y);
+    const __m128 v = Selectx4(useY, y, Selectx4(useXForV, x, z));
+    const __m128 signU = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(1)), 31));
+    const __m128 signV = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(2)), 30));
+    return _mm_add_ps(_mm_xor_ps(u, signU), _mm_xor_ps(v, signV));
+}
+
+// Perlin gradient noise in roughly [-1, 1]
+__m128 PerlinNoisex4(__m128 x, __m128 y, __m128 z)
+{
+    const __m128 floorX = Floorx4(x);
+    const __m128 floorY = Floorx4(y);
+    const __m128 floorZ = Floorx4(z);
+    const __m128 fx = _mm_sub_ps(x, floorX);
+    const __m128 fy = _mm_sub_ps(y, floorY);
+    const __m128 fz = _mm_sub_ps(z, floorZ);
+    const __m128i x0 = _mm_cvtps_epi32(floorX);
+    const __m128i y0 = _mm_cvtps_epi32(floorY);
+    const __m128i z0 = _mm_cvtps_epi32(floorZ);
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i x1 = _mm_add_epi32(x0, one);
+    const __m128i y1 = _mm_add_epi32(y0, one);
+    const __m128i z1 = _mm_add_epi32(z0, one);
+
+    // Quintic fade: t^3 * (t * (6t - 15) + 10)
+    auto fade = [](__m128 t)
+    {
+        const __m128 poly = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.0f)), _mm_set1_ps(15.0f))), _mm_set1_ps(10.0f));
+        return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), poly);
+    };
+    const __m128 u = fade(fx);
+    const __m128 v = fade(fy);
+    const __m128 w = fade(fz);
+
+    const __m128 fx1 = _mm_sub_ps(fx, _mm_set1_ps(1.0f));
+    const __m128 fy1 = _mm_sub_ps(fy, _mm_set1_ps(1.0f));
+    const __m128 fz1 = _mm_sub_ps(fz, _mm_set1_ps(1.0f));
+
+    const __m128 n000 = Gradientx4(HashLatticex4(x0, y0, z0), fx, fy, fz);
+    const __m128 n100 = Gradientx4(HashLatticex4(x1, y0, z0), fx1, fy, fz);
+    const __m128 n010 = Gradientx4(HashLatticex4(x0, y1, z0), fx, fy1, fz);
+    const __m128 n110 = Gradientx4(HashLatticex4(x1, y1, z0), fx1, fy1, fz);
+    const __m128 n001 = Gradientx4(HashLatticex4(x0, y0, z1), fx, fy, fz1);
+    const __m128 n101 = Gradientx4(HashLatticex4(x1, y0, z1), fx1, fy, fz1);
+    const __m128 n011 = Gradientx4(HashLatticex4(x0, y1, z1), fx, fy1, fz1);
+    const __m128 n111 = Gradientx4(HashLatticex4(x1, y1, z1), fx1, fy1, fz1);
+
+    const __m128 nx00 = Lerpx4(n000, n100, u);
+    const __m128 nx10 = Lerpx4(n010, n110, u);
+    const __m128 nx01 = Lerpx4(n001, n101, u);
+    const __m128 nx11 = Lerpx4(n011, n111, u);
+    return Lerpx4(Lerpx4(nx00, nx10, v), Lerpx4(nx01, nx11, v), w);
+}
+
+// Distance to the nearest of one jittered feature point per unit cell (Worley F1)
+__m128 CellularNoisex4(__m128 x, __m128 y, __m128 z)
+{
+    const __m128 floorX = Floorx4(x);
+    const __m128 floorY = Floorx4(y);
+    const __m128 floorZ = Floorx4(z);
+    const __m128 fx = _mm_sub_ps(x, floorX);
+    const __m128 fy = _mm_sub_ps(y, floorY);
+    const __m128 fz = _mm_sub_ps(z, floorZ);
+    const __m128i cellX = _mm_cvtps_epi32(floorX);
+    const __m128i cellY = _mm_cvtps_epi32(floorY);
+    const __m128i cellZ = _mm_cvtps_epi32(floorZ);
+    const __m128i mask10 = _mm_set1_epi32(1023);
+    const __m128 scale10 = _mm_set1_ps(1.0f / 1024.0f);
+
+    __m128 minDistanceSq = _mm_set1_ps(FLT_MAX);
+    for (int dz = -1; dz <= 1; ++dz)
+    {
+        for (int dy = -1; dy <= 1; ++dy)
+        {
+            for (int dx = -1; dx <= 1; ++dx)
+            {
+                // Ten bits of the cell's hash per axis place its feature point
+                const __m128i hash = HashLatticex4(_mm_add_epi32(cellX, _mm_set1_epi32(dx)), _mm_add_epi32(cellY, _mm_set1_epi32(dy)), _mm_add_epi32(cellZ, _mm_set1_epi32(dz)));
+                const __m128 featureX = _mm_add_ps(_mm_set1_ps(static_cast<float>(dx)), _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(hash, mask10)), scale10));
+                const __m128 featureY = _mm_add_ps(_mm_set1_ps(static_cast<float>(dy)), _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(hash, 10), mask10)), scale10));
+                const __m128 featureZ = _mm_add_ps(_mm_set1_ps(static_cast<float>(dz)), _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(hash, 20), mask10)), scale10));
+                const __m128 offsetX = _mm_sub_ps(featureX, fx);
+                const __m128 offsetY = _mm_sub_ps(featureY, fy);
+                const __m128 offsetZ = _mm_sub_ps(featureZ, fz);
+                const __m128 distanceSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(offsetX, offsetX), _mm_mul_ps(offsetY, offsetY)), _mm_mul_ps(offsetZ, offsetZ));
+                minDistanceSq = _mm_min_ps(minDistanceSq, distanceSq);
+            }
+        }
+    }
+    return _mm_sqrt_ps(minDistanceSq);
+}
+
+enum class ProceduralPattern : uint8_t
+{
+    Checker,  // Alternating unit cubes
+    Noise,    // Four octaves of Perlin noise
+    Cellular  // Worley cells, colorA at feature points fading to colorB at distance one
+};
+
+// Solid texture evaluated from a position in the pattern's space, so it needs no bitmap or UV mapping and costs a few
+// dozen bytes however fine its detail. Patterns are evaluated four points at a time.
+class ProceduralTexture
+{
+public:
+    // Blend factors in [0, 1] from colorA towards colorB for four positions in object space
+    __m128 Evaluate(__m128 x, __m128 y, __m128 z) const
+    {
+        const __m128 scale = _mm_set1_ps(frequency);
+        x = _mm_mul_ps(x, scale);
+        y = _mm_mul_ps(y, scale);
+        z = _mm_mul_ps(z, scale);
+
+        switch (pattern)
+        {
+        case ProceduralPattern::Noise:
+        {
+            __m128 sum = _mm_setzero_ps();
+            __m128 amplitude = _mm_set1_ps(0.5f);
+            for (int octave = 0; octave < 4; ++octave)
+            {
+                sum = _mm_add_ps(sum, _mm_mul_ps(amplitude, PerlinNoisex4(x, y, z)));
+                x = _mm_mul_ps(x, _mm_set1_ps(2.0f));
+                y = _mm_mul_ps(y, _mm_set1_ps(2.0f));
+                z = _mm_mul_ps(z, _mm_set1_ps(2.0f));
+                amplitude = _mm_mul_ps(amplitude, _mm_set1_ps(0.5f));
+            }
+            const __m128 t = _mm_add_ps(_mm_set1_ps(0.5f), sum);
+            return _mm_min_ps(_mm_max_ps(t, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+        }
+        case ProceduralPattern::Cellular:
+            return _mm_min_ps(CellularNoisex4(x, y, z), _mm_set1_ps(1.0f));
+        default:
+        {
+            const __m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_cvtps_epi32(Floorx4(x)), _mm_cvtps_epi32(Floorx4(y))), _mm_cvtps_epi32(Floorx4(z)));
+            return _mm_cvtepi32_ps(_mm_and_si128(sum, _mm_set1_epi32(1)));
+        }
+        }
+    }
+
+    // Colour averaged over a rotated-grid pattern of four points spanning footprint in the tangent plane, which
+    // filters detail finer than a pixel for the price of one four-wide evaluation
+    Vector3 Sample(const Vector3& position, const Vector3& tangent, const Vector3& bitangent, float footprint) const
+    {
+        static const float kOffsetsU[4] = { -0.125f, 0.375f, 0.125f, -0.375f };
+        static const float kOffsetsV[4] = { -0.375f, -0.125f, 0.375f, 0.125f };
+
+        alignas(16) float x[4];
+        alignas(16) float y[4];
+        alignas(16) float z[4];
+        for (int i = 0; i < 4; ++i)
+        {
+            const Vector3 point = position + (tangent * kOffsetsU[i] + bitangent * kOffsetsV[i]) * footprint;
+            x[i] = point.x;
+            y[i] = point.y;
+            z[i] = point.z;
+        }
+
+        alignas(16) float t[4];
+        _mm_store_ps(t, Evaluate(_mm_load_ps(x), _mm_load_ps(y), _mm_load_ps(z)));
+        return Lerp(colorA, colorB, 0.25f * (t[0] + t[1] + t[2] + t[3]));
+    }
+
+    ProceduralPattern pattern;
+    Vector3           colorA;
+    Vector3           colorB;
+    float             frequency = 1.0f; // Pattern cells per unit distance
+};
+
+// Closed set of material kinds. Enumerators follow the alternative order of Bsdf so a variant's index is its tag.
+enum class MaterialType : uint8_t
+{
+    Diffuse,
+    Conductor,  // Perfect mirror tinted by Schlick Fresnel with albedo as normal-incidence reflectance
+    Dielectric  // Smooth glass: Fresnel-weighted reflection or refraction, with albedo tinting transmission
+};
+
+class DiffuseBsdf
+{
+public:
+    Vector3 albedo;
+    int     albedoTexture = -1; // Index into Scene::textures modulating albedo, or -1
+    int     albedoPattern = -1; // Index into Scene::patterns modulating albedo, or -1
+};
+
+class ConductorBsdf
+{
+public:
+    Vector3 albedo;
+    int     albedoTexture = -1;
+    int     albedoPattern = -1;
+};
+
+class DielectricBsdf
+{
+public:
+    Vector3 albedo;
+    float   ior = 1.5f;         // Index of refraction
+    int     albedoTexture = -1;
+    int     albedoPattern = -1;
+};
+
+using Bsdf = std::variant<DiffuseBsdf, ConductorBsdf, DielectricBsdf>;
+
+// Authoring form of a material; scenes store them flattened into a MaterialTable
+class Material
+{
+public:
+    Vector3 emissive;
+    Bsdf    bsdf;
+};
+
+// Materials in structure-of-arrays form: a tag and slot per material plus one densely packed array per kind. Visit
+// switches on the tag and hands the kind's parameters to a generic callable, so every kind gets its own inlined
+// instantiation and the integrators never go through virtual calls or variant lookups.
+class MaterialTable
+{
+public:
+    int Add(const Material& material)
+    {
+        types.push_back(static_cast<MaterialType>(material.bsdf.index()));
+        emissive.push_back(material.emissive);
+        std::visit([this](const auto& bsdf) { slots.push_back(Append(bsdf)); }, material.bsdf);
+        return static_cast<int>(types.size()) - 1;
+    }
+
+    template<class Fn>
+    auto Visit(int material, Fn&& fn) const
+    {
+        const uint32_t slot = slots[material];
+        switch (types[material])
+        {
+        case MaterialType::Conductor:
+            return fn(conductors[slot]);
+        case MaterialType::Dielectric:
+            return fn(dielectrics[slot]);
+        default:
+            return fn(diffuse[slot]);
+        }
+    }
+
+    int Size() const
+    {
+        return static_cast<int>(types.size());
+    }
+
+    std::vector<MaterialType>   types;
+    std::vector<uint32_t>       slots; // Index into the array for the material's kind
+    std::vector<Vector3>        emissive;
+    std::vector<DiffuseBsdf>    diffuse;
+    std::vector<ConductorBsdf>  conductors;
+    std::vector<DielectricBsdf> dielectrics;
+
+private:
+    uint32_t Append(const DiffuseBsdf& bsdf)
+    {
+        diffuse.push_back(bsdf);
+        return static_cast<uint32_t>(diffuse.size()) - 1;
+    }
+
+    uint32_t Append(const ConductorBsdf& bsdf)
+    {
+        conductors.push_back(bsdf);
+        return static_cast<uint32_t>(conductors.size()) - 1;
+    }
+
+    uint32_t Append(const DielectricBsdf& bsdf)
+    {
+        dielectrics.push_back(bsdf);
+        return static_cast<uint32_t>(dielectrics.size()) - 1;
+    }
+};
+
+class Sphere
+{
+public:
+    // Spheres move linearly from center at shutter open to center + motion at shutter close
+    Vector3 CenterAt(float time) const
+    {
+        return center + motion * time;
+    }
+
+    Vector3 center;
+    float   radius;
+    int     material;                // Index into Scene::materials
+    Vector3 motion = Vector3{ 0.0f };
+};
+
+// Bounding volume hierarchy over the scene's spheres. Nodes are stored depth first with both children of an interior
+// node adjacent, so every child follows its parent and bounds can be refit with a single reverse sweep.
+//
+// For motion blur each node keeps its bounds at shutter open plus how far each face moves by shutter close. Because
+// spheres move linearly, interpolating a node's bounds to a ray's time still encloses everything beneath it, so
+// traversal costs six extra multiply-adds per node over the static case.
+class Bvh
+{
+public:
+    static const int kMaxLeafSpheres = 2;
+
+    struct Node
+    {
+        Vector3 boundsMin;      // At shutter open
+        Vector3 boundsMax;
+        Vector3 boundsMinDelta; // Change from shutter open to shutter close
+        Vector3 boundsMaxDelta;
+        int     first; // Left child index for interior nodes, first entry of sphereIndices for leaves
+        int     count; // Number of spheres in a leaf; zero for interior nodes
+    };
+
+    void Build(const std::vector<Sphere>& spheres)
+    {
+        nodes.clear();
+        sphereIndices.resize(spheres.size());
+        for (int i = 0; i < static_cast<int>(spheres.size()); ++i)
+        {
+            sphereIndices[i] = i;
+        }
+
+        if (!spheres.empty())
+        {
+            nodes.reserve(2 * spheres.size());
+            nodes.push_back(Node{});
+            BuildNode(spheres, 0, 0, static_cast<int>(spheres.size()));
+        }
+    }
+
+    // Recomputes node bounds after spheres moved without changing the topology
+    void Refit(const std::vector<Sphere>& spheres)
+    {
+        for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; --i)
+        {
+            Node& node = nodes[i];
+            if (node.count > 0)
+            {
+                NodeBounds(spheres, node);
+            }
+            else
+            {
+                const Node& left = nodes[node.first];
+                const Node& right = nodes[node.first + 1];
+                const Vector3 endMin = (left.boundsMin + left.boundsMinDelta).ComponentMin(right.boundsMin + right.boundsMinDelta);
+                const Vector3 endMax = (left.boundsMax + left.boundsMaxDelta).ComponentMax(right.boundsMax + right.boundsMaxDelta);
+                node.boundsMin = left.boundsMin.ComponentMin(right.boundsMin);
+                node.boundsMax = left.boundsMax.ComponentMax(right.boundsMax);
+                node.boundsMinDelta = endMin - node.boundsMin;
+                node.boundsMaxDelta = endMax - node.boundsMax;
+            }
+        }
+    }
+
+    std::vector<Node> nodes;
+    std::vector<int>  sphereIndices;
+
+private:
+    // Sets a node's shutter-open bounds and their motion from spheres first .. first + count
+    void NodeBounds(const std::vector<Sphere>& spheres, Node& node, int first, int count) const
+    {
+        Vector3 startMin{ FLT_MAX };
+        Vector3 startMax{ -FLT_MAX };
+        Vector3 endMin{ FLT_MAX };
+        Vector3 endMax{ -FLT_MAX };
+        for (int i = first; i < first + count; ++i)
+        {
+            const Sphere& sphere = spheres[sphereIndices[i]];
+            const Vector3 endCenter = sphere.CenterAt(1.0f);
+            startMin = startMin.ComponentMin(sphere.center + (-sphere.radius));
+            startMax = startMax.ComponentMax(sphere.center + sphere.radius);
+            endMin = endMin.ComponentMin(endCenter + (-sphere.radius));
+            endMax = endMax.ComponentMax(endCenter + sphere.radius);
+        }
+
+        node.boundsMin = startMin;
+        node.boundsMax = startMax;
+        node.boundsMinDelta = endMin - startMin;
+        node.boundsMaxDelta = endMax - startMax;
+    }
+
+    void NodeBounds(const std::vector<Sphere>& spheres, Node& node) const
+    {
+        NodeBounds(spheres, node, node.first, node.count);
+    }
+
+    // Median split along the axis of greatest centroid extent
+    void BuildNode(const std::vector<Sphere>& spheres, int nodeIndex, int first, int count)
+    {
+        NodeBounds(spheres, nodes[nodeIndex], first, count);
+        if (count <= kMaxLeafSpheres)
+        {
+            nodes[nodeIndex].first = first;
+            nodes[nodeIndex].count = count;
+            return;
+        }
+
+        // Split on centroids at mid-shutter so moving spheres group with their neighbours over the whole interval
+        Vector3 centroidMin{ FLT_MAX };
+        Vector3 centroidMax{ -FLT_MAX };
+        for (int i = first; i < first + count; ++i)
+        {
+            const Vector3 center = spheres[sphereIndices[i]].CenterAt(0.5f);
+            centroidMin = centroidMin.ComponentMin(center);
+            centroidMax = centroidMax.ComponentMax(center);
+        }
+
+        const Vector3 extent = centroidMax - centroidMin;
+        const int axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+        auto axisValue = [&spheres, axis](int sphereIndex)
+        {
+            const Vector3 center = spheres[sphereIndex].CenterAt(0.5f);
+            return axis == 0 ? center.x : axis == 1 ? center.y : center.z;
+        };
+
+        const int half = count / 2;
+        std::nth_element(sphereIndices.begin() + first, sphereIndices.begin() + first + half, sphereIndices.begin() + first + count,
+            [&axisValue](int a, int b) { return axisValue(a) < axisValue(b); });
+
+        const int leftIndex = static_cast<int>(nodes.size());
+        nodes[nodeIndex].first = leftIndex;
+        nodes[nodeIndex].count = 0;
+        nodes.push_back(Node{});
+        nodes.push_back(Node{});
+        BuildNode(spheres, leftIndex, first, half);
+        BuildNode(spheres, leftIndex + 1, first + half, count - half);
+    }
+};
+
+// Axis-aligned box of participating media with extinction sigmaT * density(p) and an isotropic phase function.
+// Homogeneous media have unit density everywhere; heterogeneous media interpolate density trilinearly from a voxel
+// grid. A coarse majorant grid stores the largest density each cell can return, so delta tracking takes long
+// exponential steps through thin cells instead of paying for the densest voxel everywhere.
+class Medium
+{
+public:
+    static const int kMajorantCellVoxels = 4;
+
+    static Medium Homogeneous(const Vector3& boundsMin, const Vector3& boundsMax, float sigmaT, const Vector3& albedo)
+    {
+        Medium medium;
+        medium.boundsMin = boundsMin;
+        medium.boundsMax = boundsMax;
+        medium.sigmaT = sigmaT;
+        medium.albedo = albedo;
+        medium.BuildMajorants();
+        return medium;
+    }
+
+    // density holds resX * resY * resZ voxels, x fastest
+    static Medium Heterogeneous(const Vector3& boundsMin, const Vector3& boundsMax, float sigmaT, const Vector3& albedo,
+        int resX, int resY, int resZ, std::vector<float> density)
+    {
+        assert(density.size() == static_cast<size_t>(resX * resY * resZ));
+
+        Medium medium;
+        medium.boundsMin = boundsMin;
+        medium.boundsMax = boundsMax;
+        medium.sigmaT = sigmaT;
+        medium.albedo = albedo;
+        medium.gridRes = { resX, resY, resZ };
+        medium.density = std::move(density);
+        medium.BuildMajorants();
+        return medium;
+    }
+
+    float Density(const Vector3& point) const
+    {
+        if (density.empty())
+        {
+            return 1.0f;
+        }
+
+        // Voxel centers sit at (i + 0.5) / res in normalized box coordinates
+        const Vector3 local = (point - boundsMin) * Vector3{ gridRes[0] / (boundsMax.x - boundsMin.x), gridRes[1] / (boundsMax.y - boundsMin.y), gridRes[2] / (boundsMax.z - boundsMin.z) } + (-0.5f);
+        const float coords[3] = { local.x, local.y, local.z };
+        int base[3];
+        float frac[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float clamped = std::min(std::max(coords[axis], 0.0f), static_cast<float>(gridRes[axis] - 1));
+            base[axis] = std::min(static_cast<int>(clamped), std::max(gridRes[axis] - 2, 0));
+            frac[axis] = gridRes[axis] > 1 ? clamped - static_cast<float>(base[axis]) : 0.0f;
+        }
+
+        float result = 0.0f;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            float weight = 1.0f;
+            int voxel[3];
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                int offset = (corner >> axis) & 1;
+                voxel[axis] = std::min(base[axis] + offset, gridRes[axis] - 1);
+                weight *= offset ? frac[axis] : 1.0f - frac[axis];
+            }
+            result += weight * density[(voxel[2] * gridRes[1] + voxel[1]) * gridRes[0] + voxel[0]];
+        }
+        return result;
+    }
+
+    // Delta tracking: samples the distance to the first real collision along the ray before tMax. Returns false if the
+    // ray passes through unscattered, which happens with probability equal to the transmittance.
+    template<class Sampler>
+    bool SampleCollision(const Ray& ray, float tMax, Sampler& random, float& outDistance) const
+    {
+        bool collided = false;
+        TraverseMajorants(ray, tMax, [&](float tEnter, float tExit, float majorant)
+        {
+            const float sigmaMajorant = sigmaT * majorant;
+            if (sigmaMajorant <= 0.0f)
+            {
+                return true;
+            }
+
+            float t = tEnter;
+            while (true)
+            {
+                t -= logf(1.0f - random.NextFloat()) / sigmaMajorant;
+                if (t >= tExit)
+                {
+                    return true; // Exponential sampling is memoryless, so restart in the next cell
+                }
+                if (random.NextFloat() * majorant < Density(ray.origin + ray.direction * t))
+                {
+                    outDistance = t;
+                    collided = true;
+                    return false;
+                }
+            }
+        });
+        return collided;
+    }
+
+    // Ratio tracking: unbiased transmittance estimate along the ray up to tMax
+    float Transmittance(const Ray& ray, float tMax, Random& random) const
+    {
+        float transmittance = 1.0f;
+        TraverseMajorants(ray, tMax, [&](float tEnter, float tExit, float majorant)
+        {
+            const float sigmaMajorant = sigmaT * majorant;
+            if (sigmaMajorant <= 0.0f)
+            {
+                return true;
+            }
+
+            float t = tEnter;
+            while (true)
+            {
+                t -= logf(1.0f - random.NextFloat()) / sigmaMajorant;
+                if (t >= tExit)
+                {
+                    return true;
+                }
+                transmittance *= 1.0f - Density(ray.origin + ray.direction * t) / majorant;
+                if (transmittance <= 0.0f)
+                {
+                    transmittance = 0.0f;
+                    return false;
+                }
+            }
+        });
+        return transmittance;
+    }
+
+    Vector3              boundsMin;
+    Vector3              boundsMax;
+    float                sigmaT = 0.0f;
+    Vector3              albedo = Vector3{ 0.0f }; // Scattering over extinction per color channel
+    std::array<int, 3>   gridRes = { { 1, 1, 1 } };
+    std::vector<float>   density;                  // Empty for homogeneous media
+    std::array<int, 3>   majorantRes = { { 1, 1, 1 } };
+    std::vector<float>   majorants;
+
+private:
+    void BuildMajorants()
+    {
+        if (density.empty())
+        {
+            majorants.assign(1, 1.0f);
+            return;
+        }
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            majorantRes[axis] = (gridRes[axis] + kMajorantCellVoxels - 1) / kMajorantCellVoxels;
+        }
+
+        // Interpolation can reach one voxel beyond a cell's own voxels, so include that border
+        majorants.assign(majorantRes[0] * majorantRes[1] * majorantRes[2], 0.0f);
+        for (int z = 0; z < gridRes[2]; ++z)
+        {
+            for (int y = 0; y < gridRes[1]; ++y)
+            {
+                for (int x = 0; x < gridRes[0]; ++x)
+                {
+                    const float value = density[(z * gridRes[1] + y) * gridRes[0] + x];
+                    for (int cz = std::max(0, (z - 1) / kMajorantCellVoxels); cz <= std::min(majorantRes[2] - 1, (z + 1) / kMajorantCellVoxels); ++cz)
+                    {
+                        for (int cy = std::max(0, (y - 1) / kMajorantCellVoxels); cy <= std::min(majorantRes[1] - 1, (y + 1) / kMajorantCellVoxels); ++cy)
+                        {
+                            for (int cx = std::max(0, (x - 1) / kMajorantCellVoxels); cx <= std::min(majorantRes[0] - 1, (x + 1) / kMajorantCellVoxels); ++cx)
+                            {
+                                float& majorant = majorants[(cz * majorantRes[1] + cy) * majorantRes[0] + cx];
+                                majorant = std::max(majorant, value);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // 3D DDA over the majorant cells the ray crosses inside the box, front to back. visit(tEnter, tExit, majorant)
+    // returns false to stop.
+    template< typename VisitFunc >
+    void TraverseMajorants(const Ray& ray, float tMax, VisitFunc visit) const
+    {
+        const float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+        const float direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+        const float boxMin[3] = { boundsMin.x, boundsMin.y, boundsMin.z };
+        const float boxMax[3] = { boundsMax.x, boundsMax.y, boundsMax.z };
+
+        float tEnter = 0.0f;
+        float tExit = tMax;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const float invDirection = 1.0f / direction[axis];
+            float t0 = (boxMin[axis] - origin[axis]) * invDirection;
+            float t1 = (boxMax[axis] - origin[axis]) * invDirection;
+            tEnter = std::max(tEnter, std::min(t0, t1));
+            tExit = std::min(tExit, std::max(t0, t1));
+        }
+        if (!(tEnter < tExit))
+        {
+            return;
+        }
+
+        int cell[3];
+        int step[3];
+        float tNext[3];
+        float tDelta[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const float cellSize = (boxMax[axis] - boxMin[axis]) / static_cast<float>(majorantRes[axis]);
+            const float entry = origin[axis] + direction[axis] * tEnter;
+            cell[axis] = std::min(std::max(static_cast<int>((entry - boxMin[axis]) / cellSize), 0), majorantRes[axis] - 1);
+            if (direction[axis] > 0.0f)
+            {
+                step[axis] = 1;
+                tNext[axis] = (boxMin[axis] + (cell[axis] + 1) * cellSize - origin[axis]) / direction[axis];
+                tDelta[axis] = cellSize / direction[axis];
+            }
+            else if (direction[axis] < 0.0f)
+            {
+                step[axis] = -1;
+                tNext[axis] = (boxMin[axis] + cell[axis] * cellSize - origin[axis]) / direction[axis];
+                tDelta[axis] = -cellSize / direction[axis];
+            }
+            else
+            {
+                step[axis] = 0;
+                tNext[axis] = FLT_MAX;
+                tDelta[axis] = FLT_MAX;
+            }
+        }
+
+        float t = tEnter;
+        while (t < tExit)
+        {
+            const int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+            const float cellExit = std::min(tNext[axis], tExit);
+            if (!visit(t, cellExit, majorants[(cell[2] * majorantRes[1] + cell[1]) * majorantRes[0] + cell[0]]))
+            {
+                return;
+            }
+
+            t = cellExit;
+            cell[axis] += step[axis];
+            tNext[axis] += tDelta[axis];
+            if (cell[axis] < 0 || cell[axis] >= majorantRes[axis])
+            {
+                return;
+            }
+        }
+    }
+};
+
+class Scene
+{
+public:
+    Vector3d              origin{ 0.0 }; // World position of the frame spheres, media and cameras are given in
+    std::vector<Sphere>   spheres;
+    MaterialTable         materials;
+    std::vector<std::shared_ptr<const Texture>> textures; // Shared rather than copied when scenes are duplicated
+    std::vector<ProceduralTexture>              patterns;
+    std::vector<Medium>   media;
+    std::vector<int>      lights; // Indices of spheres with emissive materials
+    Bvh                   bvh;
+};
+
+// Converts a world position into the scene's frame. Float positions are finest near zero, so a scene spanning
+// kilometers keeps millimeter detail around the camera if its origin is placed there and everything, the camera
+// included, is authored through this.
+Vector3 ToSceneLocal(const Scene& scene, const Vector3d& world)
+{
+    return Vector3{ world - scene.origin };
+}
+
+class Hit
+{
+public:
+    Vector3 position;
+    Vector3 positionError; // Bound on position's rounding error, per component
+    Vector3 normal;
+    float   distance;
+    int     sphereIndex;
+};
+
+// Rays for a batch of pixels in structure-of-arrays form, so origins and directions can be computed four at a time
+class RayBatch
+{
+public:
+    static const int kMaxRays = 1024;
+
+    Ray Get(int i) const
+    {
+        return Ray{ Vector3{ originX[i], originY[i], originZ[i] }, Vector3{ directionX[i], directionY[i], directionZ[i] }, time[i], 0.0f, coneSpread };
+    }
+
+    int   count = 0;
+    float coneSpread = 0.0f; // Shared by all rays in the batch
+    alignas(16) float originX[kMaxRays];
+    alignas(16) float originY[kMaxRays];
+    alignas(16) float originZ[kMaxRays];
+    alignas(16) float directionX[kMaxRays];
+    alignas(16) float directionY[kMaxRays];
+    alignas(16) float directionZ[kMaxRays];
+    float             time[kMaxRays];
+};
+
+// Perspective camera with an optional thin lens. The view basis is built once at construction and Prepare() turns it
+// into a per-pixel mapping for a given image size, so generating a ray costs one multiply-add per axis plus a
+// normalize. With a nonzero aperture, ray origins are spread over the lens disk and directions aim at the point the
+// pinhole ray would hit on the focus plane, so only geometry at focusDistance stays sharp.
+class Camera
+{
+public:
+    static constexpr float kDefaultVerticalFov = 77.3196f; // Matches the original fixed view: tan(fov / 2) = 0.8
+
+    Camera() = default;
+    Camera(const Vector3& inPosition, const Vector3& inTarget, float inVerticalFov = kDefaultVerticalFov,
+        float inAperture = 0.0f, float inFocusDistance = 0.0f, float inAspect = 0.0f)
+        : position(inPosition)
+        , target(inTarget)
+        , verticalFov(inVerticalFov)
+        , aspect(inAspect)
+        , aperture(inAperture)
+        , focusDistance(inFocusDistance > 0.0f ? inFocusDistance : inPosition.Distance(inTarget))
+    {
+        const Vector3 worldUp{ 0.0f, 1.0f, 0.0f };
+        forward = (target - position).Normalize();
+        right = worldUp.Cross(forward).Normalize();
+        up = forward.Cross(right);
+    }
+
+    // Precomputes the pixel-to-ray mapping. Pixel (0, 0) maps to the top-left corner of the image.
+    void Prepare(int width, int height)
+    {
+        const float imageAspect = aspect > 0.0f ? aspect : static_cast<float>(width) / static_cast<float>(height);
+        const float halfHeight = tanf(verticalFov * (kPi / 360.0f)) * focusDistance;
+        const float halfWidth = halfHeight * imageAspect;
+
+        topLeft = position + forward * focusDistance - right * halfWidth + up * halfHeight;
+        pixelDeltaX = right * (2.0f * halfWidth / static_cast<float>(width));
+        pixelDeltaY = up * (-2.0f * halfHeight / static_cast<float>(height));
+        pixelSpread = 2.0f * halfHeight / (static_cast<float>(height) * focusDistance);
+        filmArea = 4.0f * halfWidth * halfHeight / (focusDistance * focusDistance);
+    }
+
+    // Pinhole ray through the given pixel position, ignoring the lens
+    Ray GenerateRay(float x, float y) const
+    {
+        return Ray{ position, (topLeft + pixelDeltaX * x + pixelDeltaY * y - position).Normalize(), 0.0f, 0.0f, pixelSpread };
+    }
+
+    // Single ray through the lens at the given time, mapping the two lens numbers to the disk as GenerateRays does
+    Ray GenerateRay(float x, float y, float lensRand0, float lensRand1, float time) const
+    {
+        const Vector3 focus = topLeft + pixelDeltaX * x + pixelDeltaY * y;
+        const float radius = aperture * sqrtf(lensRand0);
+        float sinAngle;
+        float cosAngle;
+        SinCos2Pi(lensRand1, sinAngle, cosAngle);
+        const Vector3 origin = position + right * (radius * cosAngle) + up * (radius * sinAngle);
+        return Ray{ origin, (focus - origin).Normalize(), time, 0.0f, pixelSpread };
+    }
+
+    // Rays for count pixel positions. Ray times are drawn from random when the shutter is open for a nonzero
+    // interval, followed by lens samples when the aperture is open, one lane of random per ray.
+    void GenerateRays(const float* pixelX, const float* pixelY, int count, RandomLanes& random, RayBatch& outBatch) const
+    {
+        assert(count <= RayBatch::kMaxRays);
+
+        if (shutterClose > shutterOpen)
+        {
+            random.Fill(outBatch.time, count);
+            for (int i = 0; i < count; ++i)
+            {
+                outBatch.time[i] = Lerp(shutterOpen, shutterClose, outBatch.time[i]);
+            }
+        }
+        else
+        {
+            std::fill(outBatch.time, outBatch.time + count, shutterOpen);
+        }
+
+        alignas(16) float lensU[RayBatch::kMaxRays];
+        alignas(16) float lensV[RayBatch::kMaxRays];
+        const int paddedCount = (count + 3) & ~3;
+        std::fill(lensU + count, lensU + paddedCount, 0.0f);
+        std::fill(lensV + count, lensV + paddedCount, 0.0f);
+        if (aperture > 0.0f)
+        {
+            // Uniform points on the lens disk
+            random.Fill(lensU, count);
+            random.Fill(lensV, count);
+            for (int i = 0; i < paddedCount; i += 4)
+            {
+                const __m128 radius = _mm_mul_ps(_mm_set1_ps(aperture), _mm_sqrt_ps(_mm_load_ps(lensU + i)));
+                __m128 sinAngle;
+                __m128 cosAngle;
+                SinCos2Pix4(_mm_load_ps(lensV + i), sinAngle, cosAngle);
+                _mm_store_ps(lensU + i, _mm_mul_ps(radius, cosAngle));
+                _mm_store_ps(lensV + i, _mm_mul_ps(radius, sinAngle));
+            }
+        }
+        else
+        {
+            std::fill(lensU, lensU + count, 0.0f);
+            std::fill(lensV, lensV + count, 0.0f);
+        }
+
+        const __m128 topLeftX = _mm_set1_ps(topLeft.x);
+        const __m128 topLeftY = _mm_set1_ps(topLeft.y);
+        const __m128 topLeftZ = _mm_set1_ps(topLeft.z);
+        for (int i = 0; i < paddedCount; i += 4)
+        {
+            // Tail lanes past count read stale pixel positions; their results are never used
+            const __m128 px = _mm_loadu_ps(pixelX + i);
+            const __m128 py = _mm_loadu_ps(pixelY + i);
+            const __m128 lu = _mm_load_ps(lensU + i);
+            const __m128 lv = _mm_load_ps(lensV + i);
+
+            const __m128 focusX = _mm_add_ps(topLeftX, _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(pixelDeltaX.x)), _mm_mul_ps(py, _mm_set1_ps(pixelDeltaY.x))));
+            const __m128 focusY = _mm_add_ps(topLeftY, _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(pixelDeltaX.y)), _mm_mul_ps(py, _mm_set1_ps(pixelDeltaY.y))));
+            const __m128 focusZ = _mm_add_ps(topLeftZ, _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(pixelDeltaX.z)), _mm_mul_ps(py, _mm_set1_ps(pixelDeltaY.z))));
+
+            const __m128 originX = _mm_add_ps(_mm_set1_ps(position.x), _mm_add_ps(_mm_mul_ps(lu, _mm_set1_ps(right.x)), _mm_mul_ps(lv, _mm_set1_ps(up.x))));
+            const __m128 originY = _mm_add_ps(_mm_set1_ps(position.y), _mm_add_ps(_mm_mul_ps(lu, _mm_set1_ps(right.y)), _mm_mul_ps(lv, _mm_set1_ps(up.y))));
+            const __m128 originZ = _mm_add_ps(_mm_set1_ps(position.z), _mm_add_ps(_mm_mul_ps(lu, _mm_set1_ps(right.z)), _mm_mul_ps(lv, _mm_set1_ps(up.z))));
+
+            const __m128 dirX = _mm_sub_ps(focusX, originX);
+            const __m128 dirY = _mm_sub_ps(focusY, originY);
+            const __m128 dirZ = _mm_sub_ps(focusZ, originZ);
+            const __m128 lengthSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dirX, dirX), _mm_mul_ps(dirY, dirY)), _mm_mul_ps(dirZ, dirZ));
+            #if USE_FAST_RSQRT == 1
+            const __m128 invLength = ReciprocalSqrtx4(lengthSq);
+            #else
+            const __m128 invLength = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(lengthSq));
+            #endif
+
+            _mm_store_ps(outBatch.originX + i, originX);
+            _mm_store_ps(outBatch.originY + i, originY);
+            _mm_store_ps(outBatch.originZ + i, originZ);
+            _mm_store_ps(outBatch.directionX + i, _mm_mul_ps(dirX, invLength));
+            _mm_store_ps(outBatch.directionY + i, _mm_mul_ps(dirY, invLength));
+            _mm_store_ps(outBatch.directionZ + i, _mm_mul_ps(dirZ, invLength));
+        }
+        outBatch.count = count;
+        outBatch.coneSpread = pixelSpread;
+    }
+
+    // Inverse of the pinhole mapping; returns false for points behind the camera
+    bool Project(const Vector3& point, float& outX, float& outY) const
+    {
+        const Vector3 toPoint = point - position;
+        const float depth = toPoint.Dot(forward);
+        if (depth <= 0.0f)
+        {
+            return false;
+        }
+
+        // Scale onto the focus plane, then solve for pixel coordinates along the orthogonal pixel deltas
+        const Vector3 planeOffset = position + toPoint * (focusDistance / depth) - topLeft;
+        outX = planeOffset.Dot(pixelDeltaX) / pixelDeltaX.Dot(pixelDeltaX);
+        outY = planeOffset.Dot(pixelDeltaY) / pixelDeltaY.Dot(pixelDeltaY);
+        return true;
+    }
+
+    // Importance the camera emits toward point, 1 / (A cos^4) for a film of area A at unit distance, so that splatting
+    // light path contributions reproduces pixel averages. Also returns the pixel position the point projects to, and
+    // zero for points behind the camera. The lens is treated as a pinhole at its center.
+    float Importance(const Vector3& point, float& outX, float& outY) const
+    {
+        if (!Project(point, outX, outY))
+        {
+            return 0.0f;
+        }
+
+        const float cosTheta = forward.Dot((point - position).Normalize());
+        const float cosSq = cosTheta * cosTheta;
+        return 1.0f / (filmArea * cosSq * cosSq);
+    }
+
+    Vector3 position;
+    Vector3 target;
+    float   verticalFov = kDefaultVerticalFov; // Degrees
+    float   aspect = 0.0f;                     // Width over height; zero uses the image's aspect ratio
+    float   aperture = 0.0f;                   // Lens radius; zero gives a pinhole camera
+    float   focusDistance = 1.0f;
+    float   shutterOpen = 0.0f;                // Shutter interval within the scene's [0, 1] motion range
+    float   shutterClose = 1.0f;
+
+private:
+    Vector3 forward;
+    Vector3 right;
+    Vector3 up;
+    Vector3 topLeft;
+    Vector3 pixelDeltaX;
+    Vector3 pixelDeltaY;
+    float   pixelSpread; // Angle subtended by one pixel at the image center, the ray cone spread of camera rays
+    float   filmArea;    // Area of the image at unit distance
+};
+
+Camera DefaultCamera()
+{
+    return Camera{ Vector3{ 0.0f, 0.5f, -1.0f }, Vector3{ 0.0f, 0.0f, 0.0f } };
+}
+
+// Circles the scene at the default camera's height and distance; angle zero is the default camera
+Camera OrbitCamera(float angle)
+{
+    return Camera{ Vector3{ sinf(angle), 0.5f, -cosf(angle) }, Vector3{ 0.0f, 0.0f, 0.0f } };
+}
+
+// Returns number of intersections, nearest first. The quadratic is solved in its numerically stable form: the
+// discriminant comes from the ray's closest approach to the center rather than from b^2 - 4ac, and the root that would
+// suffer cancellation is taken from the product of the roots, c / a, instead. Real is the arithmetic's precision; in
+// double the difference of two float positions is exact, and the hit points are rounded to float once at the end.
+template< typename Real >
+int Intersect(const Ray& ray, const Sphere& sphere, std::array<Vector3, 2>& result)
+{
+    // t = (halfB +- sqrt(discriminant)) / a
+    const Vector3T<Real> origin{ ray.origin };
+    const Vector3T<Real> direction{ ray.direction };
+    const Real radius = static_cast<Real>(sphere.radius);
+    Vector3T<Real> sphereCenterToRayOrigin = origin - Vector3T<Real>{ sphere.CenterAt(ray.time) };
+    Real a = direction.Dot(direction);
+    Real halfB = -direction.Dot(sphereCenterToRayOrigin);
+    Real c = sphereCenterToRayOrigin.Dot(sphereCenterToRayOrigin) - radius * radius;
+
+    // halfB^2 - a * c, which is a * (radius^2 - closest approach^2)
+    Real closestApproach = (sphereCenterToRayOrigin + direction * (halfB / a)).Length();
+    Real discriminant = a * (radius - closestApproach) * (radius + closestApproach);
+    if (discriminant < 0)
+    {
+        return 0;
+    }
+
+    Real q = halfB + std::copysign(std::sqrt(discriminant), halfB);
+    Real t0 = q / a;
+    Real t1 = q != 0 ? c / q : t0;
+    if (t1 < t0)
+    {
+        std::swap(t0, t1);
+    }
+
+    int numIntersections = 0;
+    if (t0 >= 0)
+    {
+        result[numIntersections++] = Vector3{ origin + direction * t0 };
+    }
+
+    // A tangent ray touches the sphere once
+    if (t1 >= 0 && discriminant > 0)
+    {
+        result[numIntersections++] = Vector3{ origin + direction * t1 };
+    }
+
+    return numIntersections;
+}
+
+// Bound on the rounding error, per component, of a point on a sphere computed as center + offset from the center
+// with length radius, as IntersectScene and emitter sampling compute them
+Vector3 SpherePointError(const Vector3& center, const Vector3& position)
+{
+    const float kGamma7 = 7.0f * 0.5f * FLT_EPSILON / (1.0f - 7.0f * 0.5f * FLT_EPSILON);
+    return Vector3{ fabsf(center.x) + fabsf(position.x - center.x), fabsf(center.y) + fabsf(position.y - center.y),
+        fabsf(center.z) + fabsf(position.z - center.z) } * kGamma7;
+}
+
+// Origin for a ray leaving a surface point towards direction's side of normal. It is moved along the normal just past
+// the point's error bounds, then each component is rounded away from the point, so the new ray starts off the surface
+// however large the point's coordinates are, rather than kEpsilon away from it.
+Vector3 OffsetRayOrigin(const Vector3& position, const Vector3& positionError, const Vector3& normal, const Vector3& direction)
+{
+    const float distance = fabsf(normal.x) * positionError.x + fabsf(normal.y) * positionError.y + fabsf(normal.z) * positionError.z;
+    const Vector3 offset = normal * (direction.Dot(normal) < 0.0f ? -distance : distance);
+    const Vector3 origin = position + offset;
+    auto roundAway = [](float value, float away) { return away > 0.0f ? nextafterf(value, FLT_MAX) : away < 0.0f ? nextafterf(value, -FLT_MAX) : value; };
+    return Vector3{ roundAway(origin.x, offset.x), roundAway(origin.y, offset.y), roundAway(origin.z, offset.z) };
+}
+
+// Slab test against a BVH node's bounds at the ray's time; returns false if the box is missed or lies entirely beyond
+// maxDistance
+bool IntersectBounds(const Ray& ray, const Vector3& invDirection, const Bvh::Node& node, float maxDistance)
+{
+    const Vector3 boundsMin = node.boundsMin + node.boundsMinDelta * ray.time;
+    const Vector3 boundsMax = node.boundsMax + node.boundsMaxDelta * ray.time;
+    float tx0 = (boundsMin.x - ray.origin.x) * invDirection.x;
+    float tx1 = (boundsMax.x - ray.origin.x) * invDirection.x;
+    float ty0 = (boundsMin.y - ray.origin.y) * invDirection.y;
+    float ty1 = (boundsMax.y - ray.origin.y) * invDirection.y;
+    float tz0 = (boundsMin.z - ray.origin.z) * invDirection.z;
+    float tz1 = (boundsMax.z - ray.origin.z) * invDirection.z;
+
+    float tNear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.0f));
+    float tFar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), maxDistance));
+    return tNear <= tFar;
+}
+
+// Walks the BVH depth first, calling visit(sphereIndex) for every sphere whose node the ray reaches within the
+// distance returned by maxDistance(). Stops early if visit returns true.
+template< typename VisitFunc, typename MaxDistanceFunc >
+void TraverseBvh(const Ray& ray, const Scene& scene, VisitFunc visit, MaxDistanceFunc maxDistance)
+{
+    if (scene.bvh.nodes.empty())
+    {
+        return;
+    }
+
+    const Vector3 invDirection{ 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+    int stack[64];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const Bvh::Node& node = scene.bvh.nodes[stack[--stackSize]];
+        if (!IntersectBounds(ray, invDirection, node, maxDistance()))
+        {
+            continue;
+        }
+
+        if (node.count > 0)
+        {
+            for (int i = node.first; i < node.first + node.count; ++i)
+            {
+                if (visit(scene.bvh.sphereIndices[i]))
+                {
+                    return;
+                }
+            }
+        }
+        else
+        {
+            stack[stackSize++] = node.first + 1;
+            stack[stackSize++] = node.first;
+        }
+    }
+}
+
+// Finds the nearest sphere along the ray; returns false if the ray escapes the scene
+bool IntersectScene(const Ray& ray, const Scene& scene, Hit& outHit)
+{
+    int nearestSphereIndex = INT_MAX;
+    float nearestDistance = FLT_MAX;
+    Vector3 nearestIntersection(FLT_MAX);
+
+    TraverseBvh(ray, scene,
+        [&](int i)
+        {
+            std::array<Vector3, 2> intersection{};
+            int numIntersections = Intersect<GeometryReal>(ray, scene.spheres[i], intersection);
+            if (numIntersections > 0)
+            {
+                float distance = (intersection[0] - ray.origin).Length();
+                if (distance < nearestDistance)
+                {
+                    nearestSphereIndex = i;
+                    nearestIntersection = intersection[0];
+                    nearestDistance = distance;
+                }
+            }
+            return false;
+        },
+        [&nearestDistance]() { return nearestDistance; });
+
+    if (nearestSphereIndex == INT_MAX)
+    {
+        return false;
+    }
+
+    // Moving the point back onto the sphere removes the error of the ray parameter, leaving only that of this step
+    const Sphere& sphere = scene.spheres[nearestSphereIndex];
+    const Vector3 center = sphere.CenterAt(ray.time);
+    const Vector3T<GeometryReal> fromCenter = Vector3T<GeometryReal>{ nearestIntersection } - Vector3T<GeometryReal>{ center };
+    outHit.position = Vector3{ Vector3T<GeometryReal>{ center } + fromCenter * (static_cast<GeometryReal>(sphere.radius) / fromCenter.Length()) };
+    outHit.positionError = SpherePointError(center, outHit.position);
+    outHit.normal = Vector3{ fromCenter.Normalize() };
+    outHit.distance = nearestDistance;
+    outHit.sphereIndex = nearestSphereIndex;
+    return true;
+}
+
+// Returns true if anything is hit closer than maxDistance
+bool IsOccluded(const Ray& ray, const Scene& scene, float maxDistance)
+{
+    bool occluded = false;
+    TraverseBvh(ray, scene,
+        [&](int i)
+        {
+            std::array<Vector3, 2> intersection{};
+            occluded = Intersect<GeometryReal>(ray, scene.spheres[i], intersection) > 0 && (intersection[0] - ray.origin).Length() < maxDistance;
+            return occluded;
+        },
+        [maxDistance]() { return maxDistance; });
+    return occluded;
+}
+
+void RandomTangentFrame(const Vector3& normal, Vector3& outTangent, Vector3& outBitangent)
+{
+    const Vector3 right{ -1.0f, 0.0f, 0.0f };
+    const Vector3 up{ 0.0f, 1.0f, 0.0f };
+
+    outTangent = normal.IsEquivalent(right) ? up : right;
+    outBitangent = normal.Cross(outTangent).Normalize();
+    outTangent = outBitangent.Cross(normal).Normalize();
+}
+
+Vector3 RandomVector(const Vector3& normal, float rand0, float rand1)
+{
+    // Random direction over hemisphere centered on (0, 1, 0)
+    // (x, y, z) = (sqrt(1 - rand0^2)*cos(2*pi*rand1), rand0, sqrt(1 - rand0^2)*sin(2*pi*rand1))
+    float sqrtFactor = sqrtf(1.0f - rand0 * rand0);
+    float cosFactor;
+    float sinFactor;
+    SinCos2Pi(rand1, sinFactor, cosFactor);
+    Vector3 randVec = Vector3{ sqrtFactor * cosFactor, rand0, sqrtFactor * sinFactor };
+
+    // Transform to 'arbitrary' tangent frame centered around normal
+    Vector3 tangent;
+    Vector3 bitangent;
+    RandomTangentFrame(normal, tangent, bitangent);
+    Vector3 rowX{ tangent.x, normal.x, bitangent.x };
+    Vector3 rowY{ tangent.y, normal.y, bitangent.y };
+    Vector3 rowZ{ tangent.z, normal.z, bitangent.z };
+
+    Vector3 result{ randVec.Dot(rowX), randVec.Dot(rowY), randVec.Dot(rowZ) };
+    return result;
+}
+
+// RandomVector for count pairs of random numbers at once, four per step, giving the same directions
+void RandomVectors(const Vector3& normal, const float* rand0, const float* rand1, int count, Vector3* outDirections)
+{
+    Vector3 tangent;
+    Vector3 bitangent;
+    RandomTangentFrame(normal, tangent, bitangent);
+
+    for (int i = 0; i < count; i += 4)
+    {
+        // A partial last step pads its missing lanes with zeros and drops their results
+        alignas(16) float u0[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        alignas(16) float u1[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        const int lanes = std::min(4, count - i);
+        std::copy(rand0 + i, rand0 + i + lanes, u0);
+        std::copy(rand1 + i, rand1 + i + lanes, u1);
+
+        const __m128 y = _mm_load_ps(u0);
+        const __m128 sqrtFactor = _mm_sqrt_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(y, y)));
+        __m128 sinFactor;
+        __m128 cosFactor;
+        SinCos2Pix4(_mm_load_ps(u1), sinFactor, cosFactor);
+        const __m128 x = _mm_mul_ps(sqrtFactor, cosFactor);
+        const __m128 z = _mm_mul_ps(sqrtFactor, sinFactor);
+
+        alignas(16) float outX[4];
+        alignas(16) float outY[4];
+        alignas(16) float outZ[4];
+        _mm_store_ps(outX, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(tangent.x)), _mm_mul_ps(y, _mm_set1_ps(normal.x))), _mm_mul_ps(z, _mm_set1_ps(bitangent.x))));
+        _mm_store_ps(outY, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(tangent.y)), _mm_mul_ps(y, _mm_set1_ps(normal.y))), _mm_mul_ps(z, _mm_set1_ps(bitangent.y))));
+        _mm_store_ps(outZ, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(tangent.z)), _mm_mul_ps(y, _mm_set1_ps(normal.z))), _mm_mul_ps(z, _mm_set1_ps(bitangent.z))));
+        for (int lane = 0; lane < lanes; ++lane)
+        {
+            outDirections[i + lane] = Vector3{ outX[lane], outY[lane], outZ[lane] };
+        }
+    }
+}
+
+Vector3 SkyColor(const Ray& ray)
+{
+    #if USE_SKY_COLOR == 1
+    return Lerp(Vector3{ 0.0f, 0.0f, 0.0f }, Vector3{ 0.25f, 0.55f, 0.75f }, ray.direction.y);
+    #else
+    UNREFERENCED_PARAMETER(ray);
+    return Vector3{ 0.0f, 0.0f, 0.0f };
+    #endif//USE_SKY_COLOR
+}
+
+// Nearest real collision over all media along the ray before tMax. Media are independent, so the first collision in
+// their combined extinction is the earliest of the per-medium collisions.
+template<class Sampler>
+bool SampleMediaCollision(const Ray& ray, const Scene& scene, float tMax, Sampler& random, float& outDistance, int& outMedium)
+{
+    outMedium = -1;
+    for (int i = 0; i < static_cast<int>(scene.media.size()); ++i)
+    {
+        float distance;
+        if (scene.media[i].SampleCollision(ray, tMax, random, distance))
+        {
+            tMax = distance;
+            outDistance = distance;
+            outMedium = i;
+        }
+    }
+    return outMedium >= 0;
+}
+
+float MediaTransmittance(const Ray& ray, const Scene& scene, float tMax, Random& random)
+{
+    float transmittance = 1.0f;
+    for (const Medium& medium : scene.media)
+    {
+        transmittance *= medium.Transmittance(ray, tMax, random);
+    }
+    return transmittance;
+}
+
+// Uniform direction on the unit sphere, i.e. a sample of the isotropic phase function
+Vector3 RandomSphereVector(float rand0, float rand1)
+{
+    float z = 1.0f - 2.0f * rand0;
+    float r = sqrtf(Max(1.0f - z * z, 0.0f));
+    float sinPhi;
+    float cosPhi;
+    SinCos2Pi(rand1, sinPhi, cosPhi);
+    return Vector3{ r * cosPhi, r * sinPhi, z };
+}
+
+// RandomSphereVector for count pairs of random numbers at once, four per step, giving the same directions
+void RandomSphereVectors(const float* rand0, const float* rand1, int count, Vector3* outDirections)
+{
+    for (int i = 0; i < count; i += 4)
+    {
+        alignas(16) float u0[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        alignas(16) float u1[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        const int lanes = std::min(4, count - i);
+        std::copy(rand0 + i, rand0 + i + lanes, u0);
+        std::copy(rand1 + i, rand1 + i + lanes, u1);
+
+        const __m128 z = _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(_mm_set1_ps(2.0f), _mm_load_ps(u0)));
+        const __m128 r = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(z, z)), _mm_setzero_ps()));
+        __m128 sinPhi;
+        __m128 cosPhi;
+        SinCos2Pix4(_mm_load_ps(u1), sinPhi, cosPhi);
+
+        alignas(16) float outX[4];
+        alignas(16) float outY[4];
+        alignas(16) float outZ[4];
+        _mm_store_ps(outX, _mm_mul_ps(r, cosPhi));
+        _mm_store_ps(outY, _mm_mul_ps(r, sinPhi));
+        _mm_store_ps(outZ, z);
+        for (int lane = 0; lane < lanes; ++lane)
+        {
+            outDirections[i + lane] = Vector3{ outX[lane], outY[lane], outZ[lane] };
+        }
+    }
+}
+
+Vector3 Reflect(const Vector3& direction, const Vector3& normal)
+{
+    return direction - normal * (2.0f * direction.Dot(normal));
+}
+
+// Unpolarized Fresnel reflectance for a smooth dielectric boundary. cosI is measured on the incident side and eta is
+// the ratio of incident to transmitted indices; returns 1 for total internal reflection.
+float FresnelDielectric(float cosI, float eta, float& outCosT)
+{
+    float sinTSq = eta * eta * Max(1.0f - cosI * cosI, 0.0f);
+    if (sinTSq >= 1.0f)
+    {
+        outCosT = 0.0f;
+        return 1.0f;
+    }
+
+    outCosT = sqrtf(1.0f - sinTSq);
+    float parallel = (cosI - eta * outCosT) / (cosI + eta * outCosT);
+    float perpendicular = (eta * cosI - outCosT) / (eta * cosI + outCosT);
+    return 0.5f * (parallel * parallel + perpendicular * perpendicular);
+}
+
+// Cone spread of rays leaving diffuse surfaces and media, where only coarse texture detail survives
+const float kDiffuseConeSpread = 0.2f;
+
+// Ray cone footprint width after travelling distance along the ray
+float ConeWidth(const Ray& ray, float distance)
+{
+    return ray.coneWidth + ray.coneSpread * distance;
+}
+
+// Latitude-longitude mapping of a sphere hit: u wraps around the vertical axis and v runs from the top pole down
+void SphereUv(const Hit& hit, float& outU, float& outV)
+{
+    outU = 0.5f + atan2f(hit.normal.z, hit.normal.x) * (1.0f / (2.0f * kPi));
+    outV = acosf(std::min(std::max(hit.normal.y, -1.0f), 1.0f)) * (1.0f / kPi);
+}
+
+// Albedo modulated by the material's image texture and procedural pattern, if it has them. The image's mip level
+// compares the ray cone's footprint, widened for oblique incidence, with the world-space size of a finest-level texel
+// at the hit; patterns are evaluated in the sphere's frame and filtered over the same footprint.
+template<class BsdfType>
+Vector3 TexturedAlbedo(const Scene& scene, const BsdfType& bsdf, const Ray& ray, const Hit& hit)
+{
+    if (bsdf.albedoTexture < 0 && bsdf.albedoPattern < 0)
+    {
+        return bsdf.albedo;
+    }
+
+    const Sphere& sphere = scene.spheres[hit.sphereIndex];
+    const float footprint = ConeWidth(ray, hit.distance) / Max(fabsf(ray.direction.Dot(hit.normal)), 0.1f);
+    Vector3 albedo = bsdf.albedo;
+
+    if (bsdf.albedoTexture >= 0)
+    {
+        float u;
+        float v;
+        SphereUv(hit, u, v);
+
+        const Texture& image = *scene.textures[bsdf.albedoTexture];
+        const float sinTheta = Max(sqrtf(Max(1.0f - hit.normal.y * hit.normal.y, 0.0f)), 0.001f);
+        const float texelWidth = 2.0f * kPi * sphere.radius * sinTheta / static_cast<float>(image.levels[0].width);
+        const float texelHeight = kPi * sphere.radius / static_cast<float>(image.levels[0].height);
+        const float lod = log2f(footprint / sqrtf(texelWidth * texelHeight));
+        albedo = albedo * SampleTexture(image, u, v, lod, TextureCache::ForThread());
+    }
+
+    if (bsdf.albedoPattern >= 0)
+    {
+        Vector3 tangent;
+        Vector3 bitangent;
+        RandomTangentFrame(hit.normal, tangent, bitangent);
+        albedo = albedo * scene.patterns[bsdf.albedoPattern].Sample(hit.position - sphere.CenterAt(ray.time), tangent, bitangent, footprint);
+    }
+
+    return albedo;
+}
+
+Vector3 SurfaceAlbedo(const Scene& scene, const Ray& ray, const Hit& hit)
+{
+    return scene.materials.Visit(scene.spheres[hit.sphereIndex].material,
+        [&](const auto& bsdf) { return TexturedAlbedo(scene, bsdf, ray, hit); });
+}
+
+// Per-kind scattering: each continues the path from a surface hit and returns the event's throughput weight.
+// Diffuse surfaces sample the hemisphere uniformly, weighting by albedo * cos to match the effective BRDF.
+template<class Sampler>
+Vector3 Scatter(const DiffuseBsdf&, const Vector3& albedo, const Ray& ray, const Hit& hit, Sampler& random, Ray& outRay)
+{
+    const Vector3& normal = hit.normal;
+
+    float rand0 = random.NextFloat();
+    float rand1 = random.NextFloat();
+    Vector3 newDir = RandomVector(normal, rand0, rand1);
+
+    float check = newDir.Dot(normal);
+    assert(check >= (0.0f - kEpsilon));
+
+    outRay = Ray{ OffsetRayOrigin(hit.position, hit.positionError, normal, newDir), newDir, ray.time };
+    return albedo * normal.Dot(newDir);
+}
+
+// Delta-specular directions are deterministic, so no direction sampling or light sampling is done
+template<class Sampler>
+Vector3 Scatter(const ConductorBsdf&, const Vector3& albedo, const Ray& ray, const Hit& hit, Sampler&, Ray& outRay)
+{
+    float cosI = Max(-ray.direction.Dot(hit.normal), 0.0f);
+    float schlick = powf(1.0f - cosI, 5.0f);
+    const Vector3 reflected = Reflect(ray.direction, hit.normal);
+    outRay = Ray{ OffsetRayOrigin(hit.position, hit.positionError, hit.normal, reflected), reflected, ray.time };
+    return albedo + (Vector3{ 1.0f } - albedo) * schlick;
+}
+
+// Spends one random number choosing between reflection and refraction in proportion to the Fresnel term, which
+// makes that weight cancel
+template<class Sampler>
+Vector3 Scatter(const DielectricBsdf& bsdf, const Vector3& albedo, const Ray& ray, const Hit& hit, Sampler& random, Ray& outRay)
+{
+    const bool entering = ray.direction.Dot(hit.normal) < 0.0f;
+    const Vector3 normal = entering ? hit.normal : hit.normal * -1.0f;
+    const float eta = entering ? 1.0f / bsdf.ior : bsdf.ior;
+    const float cosI = -ray.direction.Dot(normal);
+
+    float cosT;
+    float reflectance = FresnelDielectric(cosI, eta, cosT);
+    if (random.NextFloat() < reflectance)
+    {
+        const Vector3 reflected = Reflect(ray.direction, normal);
+        outRay = Ray{ OffsetRayOrigin(hit.position, hit.positionError, normal, reflected), reflected, ray.time };
+        return Vector3{ 1.0f };
+    }
+
+    Vector3 refracted = (ray.direction * eta + normal * (eta * cosI - cosT)).Normalize();
+    outRay = Ray{ OffsetRayOrigin(hit.position, hit.positionError, normal, refracted), refracted, ray.time };
+    return albedo;
+}
+
+// Dispatches on the hit material's kind; the generic lambda is instantiated, and inlined, once per kind. The new ray
+// inherits the cone, whose spread specular events keep and diffuse ones widen to kDiffuseConeSpread.
+template<class Sampler>
+Vector3 Scatter(const Scene& scene, const Ray& ray, const Hit& hit, Sampler& random, Ray& outRay)
+{
+    const float coneWidth = ConeWidth(ray, hit.distance);
+    const float coneSpread = ray.coneSpread;
+    const int material = scene.spheres[hit.sphereIndex].material;
+    Vector3 weight = scene.materials.Visit(material,
+        [&](const auto& bsdf) { return Scatter(bsdf, TexturedAlbedo(scene, bsdf, ray, hit), ray, hit, random, outRay); });
+    outRay.coneWidth = coneWidth;
+    outRay.coneSpread = scene.materials.types[material] == MaterialType::Diffuse ? kDiffuseConeSpread : coneSpread;
+    return weight;
+}
+
+// Online path guiding. Space is hashed into cells, each holding a histogram of incident radiance over the sphere of
+// directions, binned uniformly in cos(theta) and phi so every bin covers the same solid angle. Paths traced during
+// training passes splat the radiance they found back into the histograms, and Update() freezes the histograms into
+// per-cell sampling distributions between passes, while no worker is tracing.
+class PathGuide
+{
+public:
+    static const int kNumCells = 4096;            // Power of two; colliding cells simply share a histogram
+    static const int kBinsTheta = 8;
+    static const int kBinsPhi = 8;
+    static const int kNumBins = kBinsTheta * kBinsPhi;
+    static const int kMinCellSamples = 32;        // Records a cell needs before its distribution is used
+    static constexpr float kCellSize = 0.05f;
+    static constexpr float kGuideFraction = 0.5f; // Probability of sampling the guide rather than the BSDF
+
+    PathGuide()
+        : radiance(new std::atomic<float>[kNumCells * kNumBins])
+        , cellSamples(new std::atomic<uint32_t>[kNumCells])
+        , cdf(kNumCells * kNumBins)
+        , cellReady(kNumCells)
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        for (int i = 0; i < kNumCells * kNumBins; ++i)
+        {
+            radiance[i].store(0.0f, std::memory_order_relaxed);
+        }
+        for (int i = 0; i < kNumCells; ++i)
+        {
+            cellSamples[i].store(0, std::memory_order_relaxed);
+        }
+        std::fill(cellReady.begin(), cellReady.end(), 0);
+    }
+
+    int Cell(const Vector3& position) const
+    {
+        const uint32_t x = static_cast<uint32_t>(static_cast<int>(floorf(position.x * (1.0f / kCellSize))));
+        const uint32_t y = static_cast<uint32_t>(static_cast<int>(floorf(position.y * (1.0f / kCellSize))));
+        const uint32_t z = static_cast<uint32_t>(static_cast<int>(floorf(position.z * (1.0f / kCellSize))));
+        return static_cast<int>(HashUint(x ^ HashUint(y ^ HashUint(z))) & (kNumCells - 1));
+    }
+
+    // Adds an estimate of the radiance arriving from direction, already divided by its sampling pdf. Thread safe.
+    void Record(int cell, const Vector3& direction, float value)
+    {
+        std::atomic<float>& bin = radiance[cell * kNumBins + Bin(direction)];
+        float current = bin.load(std::memory_order_relaxed);
+        while (!bin.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+        {
+        }
+        cellSamples[cell].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Rebuilds the sampling distributions from everything recorded so far. Must not overlap with tracing.
+    void Update()
+    {
+        for (int cell = 0; cell < kNumCells; ++cell)
+        {
+            float* cellCdf = cdf.data() + cell * kNumBins;
+            float total = 0.0f;
+            for (int bin = 0; bin < kNumBins; ++bin)
+            {
+                total += radiance[cell * kNumBins + bin].load(std::memory_order_relaxed);
+                cellCdf[bin] = total;
+            }
+
+            cellReady[cell] = total > 0.0f && cellSamples[cell].load(std::memory_order_relaxed) >= kMinCellSamples;
+            if (cellReady[cell])
+            {
+                for (int bin = 0; bin < kNumBins; ++bin)
+                {
+                    cellCdf[bin] /= total;
+                }
+            }
+        }
+    }
+
+    bool IsReady(int cell) const
+    {
+        return cellReady[cell] != 0;
+    }
+
+    // Picks a bin in proportion to its recorded radiance, then a direction uniformly within the bin
+    Vector3 Sample(int cell, float rand0, float rand1, float rand2) const
+    {
+        const float* cellCdf = cdf.data() + cell * kNumBins;
+        const int bin = std::min(static_cast<int>(std::upper_bound(cellCdf, cellCdf + kNumBins, rand0) - cellCdf), kNumBins - 1);
+        const float cosTheta = 1.0f - 2.0f * (static_cast<float>(bin / kBinsPhi) + rand1) / static_cast<float>(kBinsTheta);
+        float sinPhi;
+        float cosPhi;
+        SinCos2Pi((static_cast<float>(bin % kBinsPhi) + rand2) / static_cast<float>(kBinsPhi), sinPhi, cosPhi);
+        const float sinTheta = sqrtf(Max(1.0f - cosTheta * cosTheta, 0.0f));
+        return Vector3{ sinTheta * cosPhi, cosTheta, sinTheta * sinPhi };
+    }
+
+    // Solid angle density of Sample()
+    float Pdf(int cell, const Vector3& direction) const
+    {
+        const float* cellCdf = cdf.data() + cell * kNumBins;
+        const int bin = Bin(direction);
+        const float probability = cellCdf[bin] - (bin > 0 ? cellCdf[bin - 1] : 0.0f);
+        return probability * (static_cast<float>(kNumBins) / (4.0f * kPi));
+    }
+
+    bool training = false; // Whether paths should record into the guide; changed only between passes
+
+private:
+    static int Bin(const Vector3& direction)
+    {
+        const int row = std::min(static_cast<int>((1.0f - direction.y) * 0.5f * kBinsTheta), kBinsTheta - 1);
+        float phi = atan2f(direction.z, direction.x);
+        phi = phi < 0.0f ? phi + 2.0f * kPi : phi;
+        const int column = std::min(static_cast<int>(phi * (1.0f / (2.0f * kPi)) * kBinsPhi), kBinsPhi - 1);
+        return std::max(row, 0) * kBinsPhi + column;
+    }
+
+    std::unique_ptr<std::atomic<float>[]>    radiance;    // Training histograms
+    std::unique_ptr<std::atomic<uint32_t>[]> cellSamples;
+    std::vector<float>                       cdf;         // Frozen per-cell distributions, cumulative over bins
+    std::vector<uint8_t>                     cellReady;
+};
+
+// Diffuse scattering with path guiding: one-sample MIS between the cell's learned distribution and uniform hemisphere
+// sampling, weighted by the mixture pdf (the balance heuristic), so guided paths stay unbiased and directions the guide
+// has not learned are still reached. Also returns the cell and the mixture pdf for training.
+template<class Sampler>
+Vector3 ScatterGuided(const Scene& scene, const PathGuide& guide, const Ray& ray, const Hit& hit, Sampler& random, Ray& outRay, int& outCell, float& outPdf)
+{
+    const float kUniformPdf = 1.0f / (2.0f * kPi);
+
+    const Vector3& normal = hit.normal;
+    const Vector3 albedo = SurfaceAlbedo(scene, ray, hit);
+    const float coneWidth = ConeWidth(ray, hit.distance);
+    outCell = guide.Cell(hit.position);
+
+    Vector3 newDir;
+    if (guide.IsReady(outCell))
+    {
+        if (random.NextFloat() < PathGuide::kGuideFraction)
+        {
+            newDir = guide.Sample(outCell, random.NextFloat(), random.NextFloat(), random.NextFloat());
+        }
+        else
+        {
+            newDir = RandomVector(normal, random.NextFloat(), random.NextFloat());
+        }
+        const float bsdfPdf = normal.Dot(newDir) > 0.0f ? kUniformPdf : 0.0f;
+        outPdf = PathGuide::kGuideFraction * guide.Pdf(outCell, newDir) + (1.0f - PathGuide::kGuideFraction) * bsdfPdf;
+    }
+    else
+    {
+        newDir = RandomVector(normal, random.NextFloat(), random.NextFloat());
+        outPdf = kUniformPdf;
+    }
+
+    const float cosTheta = normal.Dot(newDir);
+    outRay = Ray{ OffsetRayOrigin(hit.position, hit.positionError, normal, newDir), newDir, ray.time, coneWidth, kDiffuseConeSpread };
+    if (cosTheta <= 0.0f)
+    {
+        return Vector3{ 0.0f };
+    }
+
+    // Same effective BRDF, albedo / (2 * pi), as unguided diffuse scattering
+    return albedo * (cosTheta * kUniformPdf / outPdf);
+}
+
+// Indirect diffuse light cached per surface cell: the average over recorded paths of cos * L arriving at a diffuse
+// point, which is the radiance it reflects per unit of albedo. Cells hash the point's position together with the axis
+// its normal is closest to, so opposite sides of thin objects stay apart. Paths record into the cache from every
+// worker at once; the averages they read are frozen between passes, like the path guide's distributions.
+class IrradianceCache
+{
+public:
+    static const int kNumCells = 1 << 16;      // Power of two; colliding cells simply share an average
+    static const int kMinCellSamples = 64;     // Records a cell needs before paths may stop at it
+    static const int kMaxCellSamples = 1 << 16; // Later records are dropped so that the float sums stay precise
+    static constexpr float kCellSize = 0.05f;
+
+    IrradianceCache()
+        : sums(new std::atomic<float>[kNumCells * 3])
+        , cellSamples(new std::atomic<uint32_t>[kNumCells])
+        , averages(kNumCells, Vector3{ 0.0f })
+        , cellReady(kNumCells)
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        for (int i = 0; i < kNumCells * 3; ++i)
+        {
+            sums[i].store(0.0f, std::memory_order_relaxed);
+        }
+        for (int i = 0; i < kNumCells; ++i)
+        {
+            cellSamples[i].store(0, std::memory_order_relaxed);
+        }
+        std::fill(cellReady.begin(), cellReady.end(), 0);
+    }
+
+    int Cell(const Vector3& position, const Vector3& normal) const
+    {
+        const float absX = fabsf(normal.x);
+        const float absY = fabsf(normal.y);
+        const float absZ = fabsf(normal.z);
+        const int axis = absX >= absY && absX >= absZ ? 0 : absY >= absZ ? 1 : 2;
+        const float component = axis == 0 ? normal.x : axis == 1 ? normal.y : normal.z;
+        const uint32_t side = static_cast<uint32_t>(axis * 2 + (component < 0.0f ? 1 : 0));
+
+        const uint32_t x = static_cast<uint32_t>(static_cast<int>(floorf(position.x * (1.0f / kCellSize))));
+        const uint32_t y = static_cast<uint32_t>(static_cast<int>(floorf(position.y * (1.0f / kCellSize))));
+        const uint32_t z = static_cast<uint32_t>(static_cast<int>(floorf(position.z * (1.0f / kCellSize))));
+        return static_cast<int>(HashUint(side ^ HashUint(x ^ HashUint(y ^ HashUint(z)))) & (kNumCells - 1));
+    }
+
+    // Adds one estimate of cos * L at a point in cell. Thread safe.
+    void Record(int cell, const Vector3& value)
+    {
+        if (cellSamples[cell].fetch_add(1, std::memory_order_relaxed) >= kMaxCellSamples)
+        {
+            return;
+        }
+
+        const float components[3] = { value.x, value.y, value.z };
+        for (int i = 0; i < 3; ++i)
+        {
+            std::atomic<float>& sum = sums[cell * 3 + i];
+            float current = sum.load(std::memory_order_relaxed);
+            while (!sum.compare_exchange_weak(current, current + components[i], std::memory_order_relaxed))
+            {
+            }
+        }
+    }
+
+    // Freezes the averages of everything recorded so far. Must not overlap with tracing.
+    void Update()
+    {
+        for (int cell = 0; cell < kNumCells; ++cell)
+        {
+            const uint32_t samples = std::min<uint32_t>(cellSamples[cell].load(std::memory_order_relaxed), kMaxCellSamples);
+            cellReady[cell] = samples >= kMinCellSamples;
+            if (cellReady[cell])
+            {
+                const float invSamples = 1.0f / static_cast<float>(samples);
+                averages[cell] = Vector3{ sums[cell * 3].load(std::memory_order_relaxed), sums[cell * 3 + 1].load(std::memory_order_relaxed),
+                    sums[cell * 3 + 2].load(std::memory_order_relaxed) } * invSamples;
+            }
+        }
+    }
+
+    bool IsReady(int cell) const
+    {
+        return cellReady[cell] != 0;
+    }
+
+    const Vector3& Irradiance(int cell) const
+    {
+        return averages[cell];
+    }
+
+private:
+    std::unique_ptr<std::atomic<float>[]>    sums;        // Running per-channel totals of the recorded estimates
+    std::unique_ptr<std::atomic<uint32_t>[]> cellSamples;
+    std::vector<Vector3>                     averages;    // Frozen by Update()
+    std::vector<uint8_t>                     cellReady;
+};
+
+// With a guide, diffuse bounces are guided and, during training, each one records the radiance the rest of the path
+// brought back along its direction. With an irradiance cache, early diffuse vertices record the light they gathered
+// and later ones reuse it where the cache is filled. Sampler is Random, or anything else that hands out uniform
+// numbers through NextFloat().
+template<class Sampler>
+Vector3 TracePath(const Ray& ray, const Scene& scene, Sampler& random, PathGuide* guide = nullptr, IrradianceCache* irradianceCache = nullptr)
+{
+    const int kMaxBounces = 6;
+
+    struct GuideVertex
+    {
+        int     cell;
+        Vector3 direction;
+        Vector3 throughput; // Path throughput including this vertex's scattering weight
+        Vector3 radiance;   // Radiance gathered before leaving this vertex
+        float   pdf;
+    };
+    GuideVertex guideVertices[kMaxBounces];
+    int numGuideVertices = 0;
+
+    // Only vertices with several bounces left after them record into the irradiance cache, since later ones would
+    // record light cut short by kMaxBounces
+    const int kMaxCacheRecordBounce = 2;
+    struct CacheVertex
+    {
+        int     cell;
+        Vector3 weight;   // Throughput up to the vertex times its albedo
+        Vector3 radiance; // Radiance gathered before leaving this vertex
+    };
+    CacheVertex cacheVertices[kMaxCacheRecordBounce + 1];
+    int numCacheVertices = 0;
+
+    Vector3 radiance{ 0.0f };
+    Vector3 throughput{ 1.0f };
+    Ray currentRay = ray;
+    for (int bounce = 0; bounce < kMaxBounces; ++bounce)
+    {
+        Hit hit;
+        const bool hitSurface = IntersectScene(currentRay, scene, hit);
+
+        // Delta tracking decides whether the ray scatters in a medium before reaching the surface. With the isotropic
+        // phase function sampled exactly, a real collision only scales throughput by the medium's albedo.
+        float collisionDistance;
+        int medium;
+        if (!scene.media.empty() && SampleMediaCollision(currentRay, scene, hitSurface ? hit.distance : FLT_MAX, random, collisionDistance, medium))
+        {
+            throughput = throughput * scene.media[medium].albedo;
+            float rand0 = random.NextFloat();
+            float rand1 = random.NextFloat();
+            currentRay = Ray{ currentRay.origin + currentRay.direction * collisionDistance, RandomSphereVector(rand0, rand1), currentRay.time,
+                ConeWidth(currentRay, collisionDistance), kDiffuseConeSpread };
+            continue;
+        }
+
+        if (!hitSurface)
+        {
+            radiance = radiance + throughput * SkyColor(currentRay);
+            break;
+        }
+
+        const int material = scene.spheres[hit.sphereIndex].material;
+        radiance = radiance + throughput * scene.materials.emissive[material];
+
+        // Past the first hit, a diffuse surface whose cache cell is filled ends the path with the cached light
+        if (irradianceCache != nullptr && scene.materials.types[material] == MaterialType::Diffuse)
+        {
+            const int cell = irradianceCache->Cell(hit.position, hit.normal);
+            const Vector3 weight = throughput * SurfaceAlbedo(scene, currentRay, hit);
+            if (bounce > 0 && irradianceCache->IsReady(cell))
+            {
+                radiance = radiance + weight * irradianceCache->Irradiance(cell);
+                break;
+            }
+            if (bounce <= kMaxCacheRecordBounce)
+            {
+                cacheVertices[numCacheVertices++] = CacheVertex{ cell, weight, radiance };
+            }
+        }
+
+        if (guide != nullptr && scene.materials.types[material] == MaterialType::Diffuse)
+        {
+            GuideVertex& vertex = guideVertices[numGuideVertices];
+            throughput = throughput * ScatterGuided(scene, *guide, currentRay, hit, random, currentRay, vertex.cell, vertex.pdf);
+            if (guide->training)
+            {
+                vertex.direction = currentRay.direction;
+                vertex.throughput = throughput;
+                vertex.radiance = radiance;
+                ++numGuideVertices;
+            }
+            if (Luminance(throughput) <= 0.0f)
+            {
+                break;
+            }
+        }
+        else
+        {
+            throughput = throughput * Scatter(scene, currentRay, hit, random, currentRay);
+        }
+    }
+
+    // Incident radiance at a vertex is what the path gathered after it, divided by the throughput up to it
+    for (int i = 0; i < numGuideVertices; ++i)
+    {
+        const GuideVertex& vertex = guideVertices[i];
+        const float vertexThroughput = Luminance(vertex.throughput);
+        if (vertexThroughput > 0.0f)
+        {
+            guide->Record(vertex.cell, vertex.direction, Luminance(radiance - vertex.radiance) / (vertexThroughput * vertex.pdf));
+        }
+    }
+
+    // Likewise cos * L at a vertex is what the path gathered after it, divided by the throughput and albedo up to it
+    for (int i = 0; i < numCacheVertices; ++i)
+    {
+        const CacheVertex& vertex = cacheVertices[i];
+        if (vertex.weight.x > 0.0f && vertex.weight.y > 0.0f && vertex.weight.z > 0.0f)
+        {
+            const Vector3 gathered = radiance - vertex.radiance;
+            irradianceCache->Record(vertex.cell, Vector3{ gathered.x / vertex.weight.x, gathered.y / vertex.weight.y, gathered.z / vertex.weight.z });
+        }
+    }
+
+    return radiance;
+}
+
+// Cheap integrator for layout previews and thumbnails: emission and direct light at the first diffuse hit plus
+// short-range ambient occlusion, with no indirect bounces; mirror and glass surfaces in front of it are followed.
+// Uses the same effective BRDF as TracePath, whose estimator albedo * L * cos over uniformly sampled hemisphere
+// directions corresponds to albedo / (2 * pi). Media only attenuate, via ratio-tracked transmittance along the camera
+// and shadow rays; in-scattering is ignored.
+Vector3 TraceDirect(const Ray& cameraRay, const Scene& scene, Random& random)
+{
+    const int   kNumAoSamples = 2;
+    const float kAoRadius = 0.1f;
+    const float kAmbientIntensity = 0.1f;
+    const int   kMaxSpecularDepth = 4;
+
+    // Follow mirror and glass surfaces until the first diffuse hit, which is shaded as usual
+    Ray ray = cameraRay;
+    Hit hit;
+    Vector3 weight{ 1.0f };
+    Vector3 specularEmission{ 0.0f };
+    for (int depth = 0; ; ++depth)
+    {
+        if (!IntersectScene(ray, scene, hit))
+        {
+            return specularEmission + weight * SkyColor(ray);
+        }
+
+        if (!scene.media.empty())
+        {
+            weight = weight * MediaTransmittance(ray, scene, hit.distance, random);
+        }
+
+        const int surface = scene.spheres[hit.sphereIndex].material;
+        if (scene.materials.types[surface] == MaterialType::Diffuse || depth == kMaxSpecularDepth)
+        {
+            break;
+        }
+
+        specularEmission = specularEmission + weight * scene.materials.emissive[surface];
+        weight = weight * Scatter(scene, ray, hit, random, ray);
+    }
+
+    const int material = scene.spheres[hit.sphereIndex].material;
+    const Vector3 albedo = SurfaceAlbedo(scene, ray, hit);
+    const Vector3 brdf = albedo * (1.0f / (2.0f * kPi));
+    const Vector3 origin = OffsetRayOrigin(hit.position, hit.positionError, hit.normal, hit.normal);
+    Vector3 color = scene.materials.emissive[material];
+
+    // One sample per light, uniformly distributed over the cone the light sphere subtends
+    for (int lightIndex : scene.lights)
+    {
+        const Sphere& light = scene.spheres[lightIndex];
+        if (lightIndex == hit.sphereIndex)
+        {
+            continue;
+        }
+
+        Vector3 toLight = light.CenterAt(ray.time) - origin;
+        float distanceSq = toLight.Dot(toLight);
+        float sinThetaMaxSq = light.radius * light.radius / distanceSq;
+        if (sinThetaMaxSq >= 1.0f)
+        {
+            continue;
+        }
+
+        float cosThetaMax = sqrtf(1.0f - sinThetaMaxSq);
+        float cosTheta = Lerp(1.0f, cosThetaMax, random.NextFloat());
+        float sinTheta = sqrtf(Max(1.0f - cosTheta * cosTheta, 0.0f));
+        float sinPhi;
+        float cosPhi;
+        SinCos2Pi(random.NextFloat(), sinPhi, cosPhi);
+
+        Vector3 axis = toLight * (1.0f / sqrtf(distanceSq));
+        Vector3 tangent;
+        Vector3 bitangent;
+        RandomTangentFrame(axis, tangent, bitangent);
+        Vector3 lightDir = tangent * (sinTheta * cosPhi) + axis * cosTheta + bitangent * (sinTheta * sinPhi);
+
+        float cosSurface = hit.normal.Dot(lightDir);
+        if (cosSurface <= 0.0f)
+        {
+            continue;
+        }
+
+        Hit lightHit;
+        const Ray shadowRay{ origin, lightDir, ray.time };
+        if (IntersectScene(shadowRay, scene, lightHit) && lightHit.sphereIndex == lightIndex)
+        {
+            float solidAngle = 2.0f * kPi * (1.0f - cosThetaMax);
+            float transmittance = scene.media.empty() ? 1.0f : MediaTransmittance(shadowRay, scene, lightHit.distance, random);
+            color = color + brdf * scene.materials.emissive[light.material] * (cosSurface * solidAngle * transmittance);
+        }
+    }
+
+    // Fraction of short hemisphere rays that escape, applied to a constant ambient term
+    float aoRand0[kNumAoSamples];
+    float aoRand1[kNumAoSamples];
+    for (int s = 0; s < kNumAoSamples; ++s)
+    {
+        aoRand0[s] = random.NextFloat();
+        aoRand1[s] = random.NextFloat();
+    }
+    Vector3 aoDirs[kNumAoSamples];
+    RandomVectors(hit.normal, aoRand0, aoRand1, kNumAoSamples, aoDirs);
+
+    int numUnoccluded = 0;
+    for (int s = 0; s < kNumAoSamples; ++s)
+    {
+        if (!IsOccluded(Ray{ origin, aoDirs[s], ray.time }, scene, kAoRadius))
+        {
+            ++numUnoccluded;
+        }
+    }
+    float ambient = kAmbientIntensity * static_cast<float>(numUnoccluded) / static_cast<float>(kNumAoSamples);
+
+    return specularEmission + (color + albedo * ambient) * weight;
+}
+
+// Diffuse surface point to be lit by resampled light samples
+class ShadingPoint
+{
+public:
+    Vector3 position;
+    Vector3 normal;
+    Vector3 albedo;
+    int     sphereIndex = -1;
+    float   time = 0.0f;
+    Vector3 positionError{ 0.0f };
+};
+
+// Direct light at a diffuse point from one point on an emitter, before visibility and per unit of emitter area, so
+// that dividing by an area density gives an estimate. Also returns the direction and distance to the emitter point.
+Vector3 UnshadowedLight(const Scene& scene, const ShadingPoint& point, int light, const Vector3& lightNormal, Vector3& outDirection, float& outDistance)
+{
+    if (light == point.sphereIndex)
+    {
+        return Vector3{ 0.0f };
+    }
+
+    const Sphere& sphere = scene.spheres[light];
+    const Vector3 toLight = sphere.CenterAt(point.time) + lightNormal * sphere.radius - point.position;
+    outDistance = toLight.Length();
+    outDirection = toLight * (1.0f / outDistance);
+    const float cosSurface = point.normal.Dot(outDirection);
+    const float cosLight = -lightNormal.Dot(outDirection);
+    if (cosSurface <= 0.0f || cosLight <= 0.0f)
+    {
+        return Vector3{ 0.0f };
+    }
+    return point.albedo * scene.materials.emissive[sphere.material] * (cosSurface * cosLight / (2.0f * kPi * outDistance * outDistance));
+}
+
+// Reservoir for resampled importance sampling of direct light (ReSTIR). It streams through weighted candidate points
+// on emitters and keeps one with probability proportional to its weight. A point is kept as its emitter and the
+// direction from the emitter's center, so that it follows the emitter when it moves.
+class LightReservoir
+{
+public:
+    // Offers a candidate whose target density at the reservoir's surface is inTargetPdf
+    void Update(int inLight, const Vector3& inLightNormal, float weight, float inTargetPdf, float rand)
+    {
+        weightSum += weight;
+        if (weight > 0.0f && rand * weightSum < weight)
+        {
+            light = inLight;
+            lightNormal = inLightNormal;
+            targetPdf = inTargetPdf;
+        }
+    }
+
+    // Folds in another surface's reservoir, whose sample has target density otherTargetPdf here. Counting at most
+    // maxCount of its candidates bounds how much an old reservoir can outweigh fresh ones.
+    void Merge(const LightReservoir& other, float otherTargetPdf, int maxCount, float rand)
+    {
+        const int otherCount = std::min(other.count, maxCount);
+        Update(other.light, other.lightNormal, otherTargetPdf * other.ContributionWeight() * static_cast<float>(otherCount), otherTargetPdf, rand);
+        count += otherCount;
+    }
+
+    // Weight that turns the kept sample's unshadowed light into an estimate of the total, in place of an area density
+    float ContributionWeight() const
+    {
+        return light >= 0 && targetPdf > 0.0f && count > 0 ? weightSum / (static_cast<float>(count) * targetPdf) : 0.0f;
+    }
+
+    int     light = -1;            // Sphere index of the kept sample, or -1 when there is none
+    Vector3 lightNormal{ 0.0f };
+    float   weightSum = 0.0f;
+    float   targetPdf = 0.0f;      // Luminance of the kept sample's unshadowed light
+    int     count = 0;             // Candidates seen
+};
+
+// Vertex of a camera or light subpath for bidirectional path tracing. Densities are per unit area so that the
+// probabilities of building the same path with different strategies can be compared.
+class BdptVertex
+{
+public:
+    enum class Type : uint8_t
+    {
+        Camera,
+        Light,  // Point sampled on an emitter
+        Surface
+    };
+
+    Vector3 position{ 0.0f };
+    Vector3 normal{ 0.0f };        // Zero for the camera
+    Vector3 beta{ 0.0f };          // Subpath throughput up to this vertex; includes emission and its density for lights
+    Vector3 albedo{ 0.0f };        // Diffuse surfaces only
+    Vector3 positionError{ 0.0f }; // Bound on position's rounding error, per component
+    int     sphereIndex = -1;
+    Type    type = Type::Surface;
+    bool    delta = false;         // Specular surface, which cannot be connected to
+    float   pdfFwd = 0.0f;         // Density of this vertex when sampled from its predecessor in its own subpath
+    float   pdfRev = 0.0f;         // Density of this vertex when sampled from the opposite direction
+};
+
+// Converts a solid angle density for leaving from towards to into an area density at to
+float AreaDensity(float pdfSolidAngle, const BdptVertex& from, const BdptVertex& to)
+{
+    const Vector3 offset = to.position - from.position;
+    const float distanceSq = offset.Dot(offset);
+    return pdfSolidAngle * fabsf(to.normal.Dot(offset)) / (distanceSq * sqrtf(distanceSq));
+}
+
+// Area density at to of continuing a subpath from vertex from: uniform hemisphere sampling for diffuse surfaces and
+// emission alike, and zero for the camera and specular surfaces, whose deltas the weights treat separately
+float VertexDensity(const BdptVertex& from, const BdptVertex& to)
+{
+    if (from.type == BdptVertex::Type::Camera || from.delta || from.normal.Dot(to.position - from.position) <= 0.0f)
+    {
+        return 0.0f;
+    }
+    return AreaDensity(1.0f / (2.0f * kPi), from, to);
+}
+
+// Area density of choosing vertex's point on an emitter when starting a light subpath
+float LightOriginDensity(const Scene& scene, const BdptVertex& vertex)
+{
+    const float radius = scene.spheres[vertex.sphereIndex].radius;
+    return 1.0f / (static_cast<float>(scene.lights.size()) * 4.0f * kPi * radius * radius);
+}
+
+// Extends a subpath from vertices[0] along ray until it escapes or holds maxVertices vertices and returns the vertex
+// count; ray is left as the last ray traced. Scattering matches TracePath.
+int RandomWalk(const Scene& scene, Ray& ray, Vector3 beta, float pdfDir, Random& random, BdptVertex* vertices, int maxVertices)
+{
+    const float kUniformPdf = 1.0f / (2.0f * kPi);
+
+    int numVertices = 1;
+    while (numVertices < maxVertices)
+    {
+        Hit hit;
+        if (!IntersectScene(ray, scene, hit))
+        {
+            break;
+        }
+
+        BdptVertex& vertex = vertices[numVertices];
+        BdptVertex& previous = vertices[numVertices - 1];
+        vertex = BdptVertex{ hit.position, hit.normal, beta };
+        vertex.positionError = hit.positionError;
+        vertex.sphereIndex = hit.sphereIndex;
+        vertex.pdfFwd = AreaDensity(pdfDir, previous, vertex);
+        if (++numVertices == maxVertices)
+        {
+            break;
+        }
+
+        const int material = scene.spheres[hit.sphereIndex].material;
+        float pdfRev;
+        if (scene.materials.types[material] == MaterialType::Diffuse)
+        {
+            vertex.albedo = SurfaceAlbedo(scene, ray, hit);
+            const Vector3 newDir = RandomVector(hit.normal, random.NextFloat(), random.NextFloat());
+            beta = beta * vertex.albedo * hit.normal.Dot(newDir);
+            pdfDir = kUniformPdf;
+            pdfRev = -ray.direction.Dot(hit.normal) > 0.0f ? kUniformPdf : 0.0f;
+            ray = Ray{ OffsetRayOrigin(hit.position, hit.positionError, hit.normal, newDir), newDir, ray.time };
+        }
+        else
+        {
+            vertex.delta = true;
+            beta = beta * Scatter(scene, ray, hit, random, ray);
+            pdfDir = 0.0f;
+            pdfRev = 0.0f;
+        }
+        previous.pdfRev = AreaDensity(pdfRev, vertex, previous);
+    }
+    return numVertices;
+}
+
+// Light subpath from a uniform point on a uniformly chosen emitter, emitting uniformly over its outward hemisphere.
+// Returns the vertex count, the point on the emitter included. The scene must have lights.
+int GenerateLightSubpath(const Scene& scene, float time, Random& random, BdptVertex* vertices, int maxVertices)
+{
+    const int numLights = static_cast<int>(scene.lights.size());
+    const int lightIndex = scene.lights[std::min(static_cast<int>(random.NextFloat() * static_cast<float>(numLights)), numLights - 1)];
+    const Sphere& light = scene.spheres[lightIndex];
+    const Vector3 lightNormal = RandomSphereVector(random.NextFloat(), random.NextFloat());
+    const Vector3 lightCenter = light.CenterAt(time);
+    vertices[0] = BdptVertex{ lightCenter + lightNormal * light.radius, lightNormal };
+    vertices[0].positionError = SpherePointError(lightCenter, vertices[0].position);
+    vertices[0].sphereIndex = lightIndex;
+    vertices[0].type = BdptVertex::Type::Light;
+    vertices[0].pdfFwd = LightOriginDensity(scene, vertices[0]);
+    vertices[0].beta = scene.materials.emissive[light.material] * (1.0f / vertices[0].pdfFwd);
+
+    const Vector3 emitDir = RandomVector(lightNormal, random.NextFloat(), random.NextFloat());
+    Ray lightRay{ OffsetRayOrigin(vertices[0].position, vertices[0].positionError, lightNormal, emitDir), emitDir, time };
+    return RandomWalk(scene, lightRay, vertices[0].beta * (lightNormal.Dot(emitDir) * 2.0f * kPi), 1.0f / (2.0f * kPi),
+        random, vertices, maxVertices);
+}
+
+// Balance heuristic weight of connecting the first s light and t camera vertices, from the ratios of the densities
+// with which every other strategy would have built the same path. Strategies with one camera vertex are not
+// implemented, so they are left out of the sum as well.
+float BdptMisWeight(const Scene& scene, BdptVertex* lightVertices, BdptVertex* cameraVertices, int s, int t)
+{
+    auto remap = [](float pdf) { return pdf != 0.0f ? pdf : 1.0f; };
+
+    BdptVertex& pt = cameraVertices[t - 1];
+    BdptVertex& ptMinus = cameraVertices[t - 2];
+    BdptVertex* qs = s > 0 ? &lightVertices[s - 1] : nullptr;
+    BdptVertex* qsMinus = s > 1 ? &lightVertices[s - 2] : nullptr;
+
+    // The connection changes the reverse densities at its endpoints and their predecessors; restored below
+    const float savedPt = pt.pdfRev;
+    const float savedPtMinus = ptMinus.pdfRev;
+    const float savedQs = qs != nullptr ? qs->pdfRev : 0.0f;
+    const float savedQsMinus = qsMinus != nullptr ? qsMinus->pdfRev : 0.0f;
+    if (s > 0)
+    {
+        pt.pdfRev = VertexDensity(*qs, pt);
+        ptMinus.pdfRev = VertexDensity(pt, ptMinus);
+        qs->pdfRev = VertexDensity(pt, *qs);
+        if (qsMinus != nullptr)
+        {
+            qsMinus->pdfRev = VertexDensity(*qs, *qsMinus);
+        }
+    }
+    else
+    {
+        // pt is on an emitter, so emission from it stands in for scattering
+        pt.pdfRev = LightOriginDensity(scene, pt);
+        ptMinus.pdfRev = pt.normal.Dot(ptMinus.position - pt.position) > 0.0f ? AreaDensity(1.0f / (2.0f * kPi), pt, ptMinus) : 0.0f;
+    }
+
+    float sumRatios = 0.0f;
+    float ratio = 1.0f;
+    for (int i = t - 1; i > 1; --i)
+    {
+        ratio *= remap(cameraVertices[i].pdfRev) / remap(cameraVertices[i].pdfFwd);
+        if (!cameraVertices[i].delta && !cameraVertices[i - 1].delta)
+        {
+            sumRatios += ratio;
+        }
+    }
+
+    ratio = 1.0f;
+    for (int i = s - 1; i >= 0; --i)
+    {
+        ratio *= remap(lightVertices[i].pdfRev) / remap(lightVertices[i].pdfFwd);
+        if (!lightVertices[i].delta && (i == 0 || !lightVertices[i - 1].delta))
+        {
+            sumRatios += ratio;
+        }
+    }
+
+    pt.pdfRev = savedPt;
+    ptMinus.pdfRev = savedPtMinus;
+    if (qs != nullptr)
+    {
+        qs->pdfRev = savedQs;
+    }
+    if (qsMinus != nullptr)
+    {
+        qsMinus->pdfRev = savedQsMinus;
+    }
+
+    return 1.0f / (1.0f + sumRatios);
+}
+
+// Bidirectional path tracing: a camera subpath and a light subpath started on a uniformly chosen emitter, connected
+// in every combination and weighted with multiple importance sampling. Paths have the same maximum number of surface
+// vertices as TracePath, which makes the two converge to the same image. Strategies that connect light vertices
+// directly to the camera would need splatting onto other pixels and are omitted. Scenes with media fall back to
+// TracePath, since the subpaths only interact with surfaces.
+Vector3 TraceBidirectional(const Ray& cameraRay, const Scene& scene, Random& random)
+{
+    const int kMaxSurfaceVertices = 6;
+
+    if (!scene.media.empty() || scene.lights.empty())
+    {
+        return TracePath(cameraRay, scene, random);
+    }
+
+    BdptVertex cameraVertices[kMaxSurfaceVertices + 1];
+    cameraVertices[0] = BdptVertex{ cameraRay.origin, Vector3{ 0.0f }, Vector3{ 1.0f } };
+    cameraVertices[0].type = BdptVertex::Type::Camera;
+    Ray ray = cameraRay;
+    const int numCameraVertices = RandomWalk(scene, ray, Vector3{ 1.0f }, 1.0f, random, cameraVertices, kMaxSurfaceVertices + 1);
+
+    // Only the camera subpath can find the sky
+    Vector3 radiance{ 0.0f };
+    if (numCameraVertices <= kMaxSurfaceVertices)
+    {
+        radiance = cameraVertices[numCameraVertices - 1].beta * SkyColor(ray);
+    }
+
+    BdptVertex lightVertices[kMaxSurfaceVertices];
+    const int numLightVertices = GenerateLightSubpath(scene, cameraRay.time, random, lightVertices, kMaxSurfaceVertices);
+
+    for (int t = 2; t <= numCameraVertices; ++t)
+    {
+        const BdptVertex& pt = cameraVertices[t - 1];
+        for (int s = 0; s <= numLightVertices && s + t - 1 <= kMaxSurfaceVertices; ++s)
+        {
+            Vector3 contribution{ 0.0f };
+            if (s == 0)
+            {
+                // The camera subpath reached an emitter on its own
+                const Vector3& emissive = scene.materials.emissive[scene.spheres[pt.sphereIndex].material];
+                if (emissive.Dot(Vector3{ 1.0f }) <= 0.0f || pt.normal.Dot(cameraVertices[t - 2].position - pt.position) <= 0.0f)
+                {
+                    continue;
+                }
+                contribution = pt.beta * emissive;
+            }
+            else
+            {
+                const BdptVertex& qs = lightVertices[s - 1];
+                if (pt.delta || qs.delta)
+                {
+                    continue;
+                }
+
+                Vector3 toLight = qs.position - pt.position;
+                const float distance = toLight.Length();
+                toLight = toLight * (1.0f / distance);
+                const float cosCamera = pt.normal.Dot(toLight);
+                const float cosLight = -qs.normal.Dot(toLight);
+                if (cosCamera <= 0.0f || cosLight <= 0.0f)
+                {
+                    continue;
+                }
+
+                // Light vertices carry their emission in beta; other vertices scatter with albedo / (2 * pi)
+                const Vector3 lightScatter = qs.type == BdptVertex::Type::Light ? Vector3{ 1.0f } : qs.albedo * (1.0f / (2.0f * kPi));
+                const Vector3 cameraScatter = pt.albedo * (1.0f / (2.0f * kPi));
+                contribution = qs.beta * lightScatter * cameraScatter * pt.beta * (cosCamera * cosLight / (distance * distance));
+                if (contribution.Dot(Vector3{ 1.0f }) <= 0.0f ||
+                    IsOccluded(Ray{ OffsetRayOrigin(pt.position, pt.positionError, pt.normal, toLight), toLight, cameraRay.time }, scene, distance * 0.999f))
+                {
+                    continue;
+                }
+            }
+
+            radiance = radiance + contribution * BdptMisWeight(scene, lightVertices, cameraVertices, s, t);
+        }
+    }
+
+    return radiance;
+}
+
+// Radiance toward the camera from a light subpath vertex, divided by the subpath's density and weighted by the
+// camera's importance, with the pixel position it lands on. Emitters radiate their emission uniformly; diffuse
+// vertices scatter with the usual albedo / (2 * pi). Zero for specular vertices and for occluded or unseen points.
+Vector3 ConnectToCamera(const Scene& scene, const Camera& camera, const BdptVertex& vertex, float time, float& outX, float& outY)
+{
+    if (vertex.delta)
+    {
+        return Vector3{ 0.0f };
+    }
+
+    Vector3 toCamera = camera.position - vertex.position;
+    const float distance = toCamera.Length();
+    toCamera = toCamera * (1.0f / distance);
+    const float cosSurface = vertex.normal.Dot(toCamera);
+    const float importance = camera.Importance(vertex.position, outX, outY);
+    if (cosSurface <= 0.0f || importance <= 0.0f ||
+        IsOccluded(Ray{ OffsetRayOrigin(vertex.position, vertex.positionError, vertex.normal, toCamera), toCamera, time }, scene, distance * 0.999f))
+    {
+        return Vector3{ 0.0f };
+    }
+
+    // The camera's cosine turns the importance per unit solid angle into one per unit film area
+    const float cosCamera = (vertex.position - camera.position).Dot(camera.target - camera.position) / (distance * camera.position.Distance(camera.target));
+    const Vector3 scatter = vertex.type == BdptVertex::Type::Light ? Vector3{ 1.0f } : vertex.albedo * (1.0f / (2.0f * kPi));
+    return vertex.beta * scatter * (cosSurface * cosCamera * importance / (distance * distance));
+}
+
+// Photons stored in a hashed uniform grid for fixed-radius density estimation. Cells are as wide as the lookup radius,
+// so a lookup visits the 3x3x3 cells around its point. Adding is lock-free: a photon takes the next
+// slot from an atomic counter and is pushed onto its cell's list by exchanging the list head, so every worker can
+// build the map at once. Lookups must not overlap with adding.
+class PhotonMap
+{
+public:
+    static const int kNumCells = 1 << 20; // Power of two; colliding cells share a list
+
+    // The cell table is allocated by the first reset, so renderers that never map photons don't pay for it
+    void Reset(int capacity, float inRadius)
+    {
+        if (!heads)
+        {
+            heads.reset(new std::atomic<int>[kNumCells]);
+        }
+        photons.resize(capacity);
+        for (int i = 0; i < kNumCells; ++i)
+        {
+            heads[i].store(-1, std::memory_order_relaxed);
+        }
+        count.store(0, std::memory_order_relaxed);
+        radius = inRadius;
+        numPaths = 0;
+    }
+
+    // Stores power arriving at position from direction. Thread safe; photons past the capacity are dropped.
+    void Add(const Vector3& position, const Vector3& direction, const Vector3& power)
+    {
+        const int index = count.fetch_add(1, std::memory_order_relaxed);
+        if (index >= static_cast<int>(photons.size()))
+        {
+            return;
+        }
+
+        Photon& photon = photons[index];
+        photon.position = position;
+        photon.direction = direction;
+        photon.power = power;
+        photon.next = heads[Cell(position, 0, 0, 0)].exchange(index, std::memory_order_relaxed);
+    }
+
+    // Irradiance at a point on a surface facing normal, from the photons of numPaths light paths within the radius
+    Vector3 Irradiance(const Vector3& position, const Vector3& normal) const
+    {
+        if (numPaths == 0)
+        {
+            return Vector3{ 0.0f };
+        }
+
+        // Colliding hashes are visited once
+        int cells[27];
+        int numCells = 0;
+        for (int i = 0; i < 27; ++i)
+        {
+            const int cell = Cell(position, i % 3 - 1, (i / 3) % 3 - 1, i / 9 - 1);
+            if (std::find(cells, cells + numCells, cell) == cells + numCells)
+            {
+                cells[numCells++] = cell;
+            }
+        }
+
+        Vector3 power{ 0.0f };
+        const float radiusSq = radius * radius;
+        for (int i = 0; i < numCells; ++i)
+        {
+            for (int index = heads[cells[i]].load(std::memory_order_relaxed); index >= 0; index = photons[index].next)
+            {
+                const Photon& photon = photons[index];
+                const Vector3 offset = photon.position - position;
+                if (offset.Dot(offset) < radiusSq && photon.direction.Dot(normal) > 0.0f)
+                {
+                    power = power + photon.power;
+                }
+            }
+        }
+        return power * (1.0f / (static_cast<float>(numPaths) * kPi * radiusSq));
+    }
+
+    int Size() const
+    {
+        return std::min(count.load(std::memory_order_relaxed), static_cast<int>(photons.size()));
+    }
+
+    int numPaths = 0; // Light paths traced to build the map; set once adding has finished
+
+private:
+    class Photon
+    {
+    public:
+        Vector3 position;
+        Vector3 direction; // Toward where the photon came from
+        Vector3 power;     // Flux carried, not yet divided by the number of paths
+        int     next;      // Next photon in the same cell, or -1
+    };
+
+    int Cell(const Vector3& position, int dx, int dy, int dz) const
+    {
+        const float invCellSize = 1.0f / radius;
+        const uint32_t x = static_cast<uint32_t>(static_cast<int>(floorf(position.x * invCellSize)) + dx);
+        const uint32_t y = static_cast<uint32_t>(static_cast<int>(floorf(position.y * invCellSize)) + dy);
+        const uint32_t z = static_cast<uint32_t>(static_cast<int>(floorf(position.z * invCellSize)) + dz);
+        return static_cast<int>(HashUint(x ^ HashUint(y ^ HashUint(z))) & (kNumCells - 1));
+    }
+
+    std::vector<Photon>                 photons;
+    std::unique_ptr<std::atomic<int>[]> heads;
+    std::atomic<int>                    count{ 0 };
+    float                               radius = 1.0f;
+};
+
+// Photon mapping: the camera path follows mirror and glass surfaces to the first diffuse hit, where the photon map's
+// density estimate stands in for all of the light arriving there. The estimate is blurred over the photon radius but
+// finds caustics that paths from the camera rarely do.
+Vector3 TracePhotonMapped(const Ray& cameraRay, const Scene& scene, Random& random, const PhotonMap& photonMap)
+{
+    const int kMaxBounces = 6;
+
+    Vector3 radiance{ 0.0f };
+    Vector3 throughput{ 1.0f };
+    Ray ray = cameraRay;
+    for (int bounce = 0; bounce < kMaxBounces; ++bounce)
+    {
+        Hit hit;
+        if (!IntersectScene(ray, scene, hit))
+        {
+            return radiance + throughput * SkyColor(ray);
+        }
+
+        const int material = scene.spheres[hit.sphereIndex].material;
+        radiance = radiance + throughput * scene.materials.emissive[material];
+        if (scene.materials.types[material] == MaterialType::Diffuse)
+        {
+            const Vector3 albedo = SurfaceAlbedo(scene, ray, hit);
+            return radiance + throughput * albedo * photonMap.Irradiance(hit.position, hit.normal) * (1.0f / (2.0f * kPi));
+        }
+        throughput = throughput * Scatter(scene, ray, hit, random, ray);
+    }
+    return radiance;
+}
+
+// Primary sample space sampler for Metropolis light transport. Every NextFloat() returns the next coordinate of an
+// unbounded vector of uniform numbers, so a path is a deterministic function of the vector. Iterations mutate it,
+// either perturbing every coordinate a little (small steps) or replacing them all (large steps); both are applied
+// lazily as coordinates are read, and Reject() rolls back whatever the iteration changed.
+class MltSampler
+{
+public:
+    static constexpr float kLargeStepProbability = 0.3f;
+    static constexpr float kSmallStepSigma = 0.01f;
+
+    explicit MltSampler(uint32_t seed)
+        : random(seed)
+    {}
+
+    void StartIteration()
+    {
+        ++iteration;
+        largeStep = random.NextFloat() < kLargeStepProbability;
+        index = 0;
+    }
+
+    float NextFloat()
+    {
+        if (index == samples.size())
+        {
+            // Coordinates are created as if drawn at the last large step
+            samples.push_back(PrimarySample{ random.NextFloat(), lastLargeStepIteration });
+        }
+
+        PrimarySample& sample = samples[index++];
+        Mutate(sample);
+        return sample.value;
+    }
+
+    void Accept()
+    {
+        if (largeStep)
+        {
+            lastLargeStepIteration = iteration;
+        }
+    }
+
+    void Reject()
+    {
+        for (PrimarySample& sample : samples)
+        {
+            if (sample.lastModified == iteration)
+            {
+                sample.value = sample.backupValue;
+                sample.lastModified = sample.backupModified;
+            }
+        }
+        --iteration;
+    }
+
+private:
+    class PrimarySample
+    {
+    public:
+        float    value;
+        uint64_t lastModified;     // Iteration whose mutation value reflects
+        float    backupValue = 0.0f;
+        uint64_t backupModified = 0;
+    };
+
+    void Mutate(PrimarySample& sample)
+    {
+        // A coordinate not read since before the last accepted large step was replaced by it
+        if (sample.lastModified < lastLargeStepIteration)
+        {
+            sample.value = random.NextFloat();
+            sample.lastModified = lastLargeStepIteration;
+        }
+
+        sample.backupValue = sample.value;
+        sample.backupModified = sample.lastModified;
+        if (largeStep)
+        {
+            sample.value = random.NextFloat();
+        }
+        else if (iteration > sample.lastModified)
+        {
+            // One normal step standing in for every small step the coordinate missed, wrapped around [0, 1)
+            const float rand0 = random.NextFloat();
+            const float rand1 = random.NextFloat();
+            float sinAngle;
+            float cosAngle;
+            SinCos2Pi(rand1, sinAngle, cosAngle);
+            const float normal = sqrtf(-2.0f * logf(1.0f - rand0)) * cosAngle;
+            sample.value += normal * kSmallStepSigma * sqrtf(static_cast<float>(iteration - sample.lastModified));
+            sample.value -= floorf(sample.value);
+        }
+        sample.lastModified = iteration;
+    }
+
+    Random                     random;
+    std::vector<PrimarySample> samples;
+    size_t                     index = 0;
+    uint64_t                   iteration = 0;
+    uint64_t                   lastLargeStepIteration = 0;
+    bool                       largeStep = false;
+};
+
+// Radiance for one point of primary sample space. The first coordinates pick a film position, shutter time and lens
+// position, and the rest drive TracePath. Film positions round to the nearest pixel, whose progressive samples are
+// centred on it.
+Vector3 TracePrimarySample(const Scene& scene, const Camera& camera, int width, int height, MltSampler& sampler, float& outX, float& outY)
+{
+    outX = sampler.NextFloat() * static_cast<float>(width) - 0.5f;
+    outY = sampler.NextFloat() * static_cast<float>(height) - 0.5f;
+    const float time = Lerp(camera.shutterOpen, camera.shutterClose, sampler.NextFloat());
+    const float lensRand0 = sampler.NextFloat();
+    const float lensRand1 = sampler.NextFloat();
+    return TracePath(camera.GenerateRay(outX, outY, lensRand0, lensRand1, time), scene, sampler);
+}
+
+Sphere GenerateTangentSphere(const Sphere& sphere, const Vector3& center, int material)
+{
+    return Sphere{ center, (center - sphere.center).Length() - sphere.radius, material };
+}
+
+Sphere GenerateOffsetSphere(const Sphere& sphere, const Vector3& center, float offset, int material)
+{
+    return Sphere{ center, (center - sphere.center).Length() - sphere.radius - offset, material };
+}
+
+// Spherical puff of smoke with a rippled falloff, voxelized into a heterogeneous medium
+Medium GenerateSmokeMedium(const Vector3& center, float radius, int resolution, float sigmaT)
+{
+    std::vector<float> density(resolution * resolution * resolution);
+    for (int z = 0; z < resolution; ++z)
+    {
+        for (int y = 0; y < resolution; ++y)
+        {
+            for (int x = 0; x < resolution; ++x)
+            {
+                Vector3 local = Vector3{ static_cast<float>(x), static_cast<float>(y), static_cast<float>(z) } * (2.0f / static_cast<float>(resolution)) + (1.0f / static_cast<float>(resolution) - 1.0f);
+                float falloff = Saturate(1.0f - local.Length());
+                float ripple = 0.5f + 0.5f * sinf(9.0f * local.x) * sinf(7.0f * local.y + 1.0f) * sinf(8.0f * local.z + 2.0f);
+                density[(z * resolution + y) * resolution + x] = falloff * ripple;
+            }
+        }
+    }
+
+    return Medium::Heterogeneous(center + (-radius), center + radius, sigmaT, Vector3{ 0.8f, 0.8f, 0.8f }, resolution, resolution, resolution, std::move(density));
+}
+
+// Latitude-longitude grid with coloured bands, for checking texture mapping and filtering
+std::shared_ptr<const Texture> GenerateGridTexture(int width, int height)
+{
+    std::vector<uint32_t> texels(static_cast<size_t>(width) * height);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            const bool line = (x % 32) < 2 || (y % 32) < 2;
+            const uint32_t band = ((x / 64) + (y / 64)) % 3;
+            const uint32_t color = band == 0 ? 0xffd080 : band == 1 ? 0x80c0ff : 0xf0f0f0;
+            texels[y * width + x] = line ? 0x202020 : color;
+        }
+    }
+
+    return std::make_shared<const Texture>(width, height, texels.data());
+}
+
+void InitScene(Scene& scene)
+{
+    std::vector<Sphere>& spheres = scene.spheres;
+    std::vector<Material> materials;
+    materials.emplace_back(Material{ Vector3{0.0f, 0.0f, 0.0f}, DiffuseBsdf{ Vector3{1.0f, 1.0f, 1.0f} } });
+    materials.emplace_back(Material{ Vector3{10.0f, 10.0f, 10.0f}, DiffuseBsdf{ Vector3{0.5f, 1.0f, 0.5f} } });
+    materials.emplace_back(Material{ Vector3{0.0f, 0.0f, 0.0f}, DiffuseBsdf{ Vector3{1.0f, 0.5f, 0.5f} } });
+    materials.emplace_back(Material{ Vector3{0.0f, 0.0f, 0.0f}, DiffuseBsdf{ Vector3{0.5f, 0.5f, 1.0f} } });
+    materials.emplace_back(Material{ Vector3{0.0f, 0.0f, 0.0f}, DiffuseBsdf{ Vector3{0.5f, 1.0f, 0.75f} } });
+    materials.emplace_back(Material{ Vector3{10.0f, 5.0f, 5.0f}, DiffuseBsdf{ Vector3{1.0f, 1.0f, 0.5f} } });
+    materials.emplace_back(Material{ Vector3{0.0f, 0.0f, 0.0f}, DiffuseBsdf{ Vector3{1.0f, 1.0f, 1.0f} } });
+    materials.emplace_back(Material{ Vector3{5.0f, 5.0f, 10.0f}, DiffuseBsdf{ Vector3{0.5f, 1.0f, 1.0f} } });
+
+    #if USE_SPECULAR_MATERIALS == 1
+    materials[3].bsdf = ConductorBsdf{ Vector3{0.5f, 0.5f, 1.0f} };
+    materials[6].bsdf = DielectricBsdf{ Vector3{1.0f, 1.0f, 1.0f}, 1.5f };
+    #endif//USE_SPECULAR_MATERIALS
+
+    #if USE_TEXTURES == 1
+    scene.textures.push_back(GenerateGridTexture(512, 256));
+    materials[2].bsdf = DiffuseBsdf{ Vector3{1.0f, 1.0f, 1.0f}, 0 };
+    #endif//USE_TEXTURES
+
+    #if USE_PROCEDURAL_TEXTURES == 1
+    scene.patterns.push_back(ProceduralTexture{ ProceduralPattern::Checker, Vector3{1.0f, 1.0f, 1.0f}, Vector3{0.3f, 0.3f, 0.3f}, 4.0f });
+    scene.patterns.push_back(ProceduralTexture{ ProceduralPattern::Noise, Vector3{0.2f, 0.3f, 0.1f}, Vector3{1.0f, 1.0f, 1.0f}, 60.0f });
+    scene.patterns.push_back(ProceduralTexture{ ProceduralPattern::Cellular, Vector3{1.0f, 1.0f, 1.0f}, Vector3{0.2f, 0.2f, 0.2f}, 16.0f });
+    materials[0].bsdf = DiffuseBsdf{ Vector3{1.0f, 1.0f, 1.0f}, -1, 0 };
+    materials[4].bsdf = DiffuseBsdf{ Vector3{0.5f, 1.0f, 0.75f}, -1, 1 };
+    materials[3].bsdf = DiffuseBsdf{ Vector3{0.5f, 0.5f, 1.0f}, -1, 2 };
+    #endif//USE_PROCEDURAL_TEXTURES
+
+    for (const Material& material : materials)
+    {
+        scene.materials.Add(material);
+    }
+
+    const float globalRadius = 100.0f;
+    Vector3 globalCenter{ 0.0f, -globalRadius, 0.0f };
+    spheres.emplace_back(Sphere{ globalCenter, {100.0f}, 0 });
+    spheres.emplace_back(GenerateOffsetSphere(spheres[0], Vector3{ 0.0f, 0.25f, 0.0f }, 0.125f, 1));
+    spheres.emplace_back(GenerateTangentSphere(spheres[0], Vector3{-0.5f, 0.125f, 0.0f}, 2));
+    spheres.emplace_back(GenerateTangentSphere(spheres[0], Vector3{ 0.5f, 0.25f, 0.5f }, 3));
+    spheres.emplace_back(GenerateTangentSphere(spheres[0], Vector3{ 0.25f, 0.05f, -0.25f }, 4));
+    spheres.emplace_back(GenerateOffsetSphere(spheres[0], Vector3{ -0.25f, 1.0f, 1.5f }, 0.5f, 5));
+    spheres.emplace_back(GenerateTangentSphere(spheres[0], Vector3{ 0.25f, 0.1f, 0.25f }, 6));
+    spheres.emplace_back(GenerateTangentSphere(spheres[0], Vector3{ -0.65f, 0.05f, -0.25f }, 7));
+
+    for (int i = 0; i < static_cast<int>(spheres.size()); ++i)
+    {
+        if (scene.materials.emissive[spheres[i].material].Dot(Vector3{ 1.0f }) > 0.0f)
+        {
+            scene.lights.push_back(i);
+        }
+    }
+
+    #if USE_MEDIA == 1
+    // Thin ground fog plus a dense smoke puff between the camera and the central light
+    scene.media.push_back(Medium::Homogeneous(Vector3{ -3.0f, 0.0f, -3.0f }, Vector3{ 3.0f, 0.1f, 3.0f }, 1.5f, Vector3{ 0.9f, 0.9f, 0.9f }));
+    scene.media.push_back(GenerateSmokeMedium(Vector3{ 0.15f, 0.3f, -0.2f }, 0.2f, 32, 40.0f));
+    #endif//USE_MEDIA
+
+    scene.bvh.Build(spheres);
+}
+
+enum class Integrator
+{
+    Path,          // Full path tracing
+    Preview,       // Direct light and ambient occlusion at the first hit only
+    Bidirectional, // Bidirectional path tracing, for scenes lit mostly by small emitters
+    Metropolis,    // Primary sample space Metropolis light transport over TracePath, for pathological lighting
+    LightTracing,  // Paths from the emitters splatted onto the film; misses everything seen through mirrors or glass
+    PhotonMap,     // Density estimation from a photon map at the first diffuse hit, for caustics
+    Restir         // Direct light only, resampled from light samples of neighboring pixels and earlier passes and frames
+};
+
+// Progressive rendering controls. With a zero time budget every pixel receives up to maxSamplesPerPixel samples;
+// otherwise passes are scheduled to fit the budget and rendering stops at the deadline.
+struct RenderSettings
+{
+    int    maxSamplesPerPixel = 1024;
+    int    samplesPerPass     = 8;
+    int    minSamplesPerPixel = 16;     // Samples taken before a pixel may be retired by adaptive sampling
+    float  relativeErrorLimit = 0.01f;  // Pixel is converged once its standard error falls below this fraction of its mean
+    double timeBudgetSeconds  = 0.0;
+    Integrator integrator     = Integrator::Path;
+
+    // Temporal reuse: when the camera moves, radiance accumulated for the previous view is reprojected through
+    // first-hit positions and kept as up to temporalHistoryLimit samples' worth of history
+    bool   temporalReuse        = false;
+    int    temporalHistoryLimit = 24;
+    float  temporalDepthTolerance  = 0.02f; // Relative depth difference beyond which a pixel counts as disoccluded
+    float  temporalNormalTolerance = 0.9f;  // Minimum cosine between current and previous first-hit normals
+
+    // Path guiding for the path integrator: the first guideTrainingPasses passes, preview levels included, learn
+    // where light comes from, and every pass samples bounces from what has been learned so far
+    bool   pathGuiding         = false;
+    int    guideTrainingPasses = 16;
+
+    // Irradiance caching for the path integrator: indirect light at diffuse hits past the first comes from a cache
+    // that paths keep filling, kept across renders of the same scene object
+    bool   irradianceCache = false;
+
+    // Photon mapping: the map is built once per render from photonPaths light paths, before the first pass
+    int    photonPaths  = 1 << 18;
+    float  photonRadius = 0.05f;
+};
+
+// Settings for interactive layout previews: one or two samples of the cheap integrator
+RenderSettings PreviewRenderSettings()
+{
+    RenderSettings settings;
+    settings.maxSamplesPerPixel = 2;
+    settings.samplesPerPass = 1;
+    settings.integrator = Integrator::Preview;
+    return settings;
+}
+
+// Settings for camera animation: few new samples per frame, blended with reprojected history
+RenderSettings AnimationRenderSettings()
+{
+    RenderSettings settings;
+    settings.maxSamplesPerPixel = 32;
+    settings.samplesPerPass = 4;
+    settings.temporalReuse = true;
+    return settings;
+}
+
+// Accumulates per-pixel sample sums so every pixel resolves to the mean of however many samples it received
+class Film
+{
+public:
+    void Resize(int inWidth, int inHeight)
+    {
+        width = inWidth;
+        height = inHeight;
+        colorSum.assign(width * height, Vector3{ 0.0f });
+        luminanceSqSum.assign(width * height, 0.0f);
+        sampleCount.assign(width * height, 0);
+    }
+
+    void AddSample(int index, const Vector3& color)
+    {
+        float luminance = Luminance(color);
+        colorSum[index] = colorSum[index] + color;
+        luminanceSqSum[index] += luminance * luminance;
+        ++sampleCount[index];
+    }
+
+    // Seeds a pixel with another film's accumulation, rescaled to at most maxSamples samples' worth of weight
+    void CopyHistory(int index, const Film& history, int historyIndex, int maxSamples)
+    {
+        int count = history.sampleCount[historyIndex];
+        float scale = count > maxSamples ? static_cast<float>(maxSamples) / static_cast<float>(count) : 1.0f;
+        colorSum[index] = history.colorSum[historyIndex] * scale;
+        luminanceSqSum[index] = history.luminanceSqSum[historyIndex] * scale;
+        sampleCount[index] = std::min(count, maxSamples);
+    }
+
+    Vector3 Resolve(int index) const
+    {
+        return sampleCount[index] > 0 ? colorSum[index] * (1.0f / static_cast<float>(sampleCount[index])) : Vector3{ 0.0f };
+    }
+
+    bool IsConverged(int index, const RenderSettings& settings) const
+    {
+        int count = sampleCount[index];
+        if (count >= settings.maxSamplesPerPixel)
+        {
+            return true;
+        }
+        if (count < settings.minSamplesPerPixel)
+        {
+            return false;
+        }
+
+        float invCount = 1.0f / static_cast<float>(count);
+        float mean = Luminance(colorSum[index]) * invCount;
+        float variance = Max(luminanceSqSum[index] * invCount - mean * mean, 0.0f);
+        float standardError = sqrtf(variance * invCount);
+        return standardError <= settings.relativeErrorLimit * Max(mean, kEpsilon);
+    }
+
+    int                  width = 0;
+    int                  height = 0;
+    std::vector<Vector3> colorSum;
+    std::vector<float>   luminanceSqSum;
+    std::vector<int>     sampleCount;
+};
+
+// Splat accumulation shared by all workers. Splats land on arbitrary pixels, so every channel is added atomically
+// instead of giving each worker a full-frame buffer to merge afterwards.
+class SplatFilm
+{
+public:
+    void Resize(int numPixels)
+    {
+        sums.reset(new std::atomic<float>[numPixels * 3]);
+        for (int i = 0; i < numPixels * 3; ++i)
+        {
+            sums[i].store(0.0f, std::memory_order_relaxed);
+        }
+    }
+
+    void Add(int index, const Vector3& value)
+    {
+        const float components[3] = { value.x, value.y, value.z };
+        for (int i = 0; i < 3; ++i)
+        {
+            std::atomic<float>& sum = sums[index * 3 + i];
+            float current = sum.load(std::memory_order_relaxed);
+            while (!sum.compare_exchange_weak(current, current + components[i], std::memory_order_relaxed))
+            {
+            }
+        }
+    }
+
+    Vector3 Get(int index) const
+    {
+        return Vector3{ sums[index * 3].load(std::memory_order_relaxed), sums[index * 3 + 1].load(std::memory_order_relaxed),
+                        sums[index * 3 + 2].load(std::memory_order_relaxed) };
+    }
+
+private:
+    std::unique_ptr<std::atomic<float>[]> sums;
+};
+
+const int kNumPreviewLevels = 3;
+const int kPreviewSteps[kNumPreviewLevels] = { 4, 2, 1 };
+
+// Renders progressively on a persistent pool of worker threads. The image is split into tiles that workers claim one
+// at a time; a worker polls the cancellation flag before every tile and every sample, so once Cancel() is called each
+// worker finishes the sample it is tracing (one TracePath call, at most kMaxBounces BVH traversals) before going idle.
+// Cancel() also waits out any end-of-pass bookkeeping already running under the lock (guide and irradiance cache
+// updates, Metropolis chain seeding, splat display). The scene and the threads are kept across restarts; only the
+// film is reset. "--selftest" measures the cancel latency of every integrator.
+//
+// The first passes form a preview pyramid: one sample for every 4x4 block, then every 2x2 block, then every pixel.
+// Coarse samples are real film samples of the block's top-left pixel, so they keep counting toward the final image;
+// until a pixel has samples of its own it displays the value of its nearest sampled coarse block.
+//
+// With temporal reuse enabled an extra pass runs before the pyramid: it traces each pixel's center ray to fill a
+// first-hit buffer, projects the hit into the previous camera and, if depth and normal agree with what that pixel
+// saw, seeds the film with the previous frame's accumulation. Disoccluded pixels start from zero.
+class Renderer
+{
+public:
+    static const int kTileSize = 32; // Must be a multiple of the coarsest preview step
+
+    Renderer()
+    {
+        InitScene(ownedScene);
+
+        int numThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        for (int i = 0; i < numThreads; ++i)
+        {
+            workers.emplace_back(&Renderer::WorkerMain, this);
+        }
+    }
+
+    ~Renderer()
+    {
+        Cancel();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            shutdown = true;
+        }
+        workCondition.notify_all();
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // Cancels any render in progress and starts a new one, reusing the scene and worker threads. A caller-provided
+    // scene must stay alive and unmodified until the render finishes or is cancelled.
+    void Start(int width, int height, const RenderSettings& inSettings, const Camera& inCamera = DefaultCamera(), const Scene* inScene = nullptr)
+    {
+        Cancel();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        settings = inSettings;
+        scene = inScene != nullptr ? inScene : &ownedScene;
+
+        // Light paths only interact with surfaces and need emitters to start from
+        const bool lightPaths = settings.integrator == Integrator::LightTracing || settings.integrator == Integrator::PhotonMap;
+        if (lightPaths && (!scene->media.empty() || scene->lights.empty()))
+        {
+            settings.integrator = Integrator::Path;
+        }
+
+        // Reservoirs hold points on emitters and ignore media
+        if (settings.integrator == Integrator::Restir && (!scene->media.empty() || scene->lights.empty()))
+        {
+            settings.integrator = Integrator::Preview;
+        }
+
+        // Splatting integrators write anywhere on the film, so they have neither preview levels nor per-pixel history.
+        // Photon mapping renders progressively, but its first pass builds the photon map.
+        const bool splatting = settings.integrator == Integrator::Metropolis || settings.integrator == Integrator::LightTracing;
+        const bool photonMapping = settings.integrator == Integrator::PhotonMap;
+        const bool restir = settings.integrator == Integrator::Restir;
+        settings.temporalReuse = settings.temporalReuse && !splatting && !photonMapping && !restir;
+
+        const bool hasHistory = settings.temporalReuse && film.width == width && film.height == height;
+        std::swap(film, historyFilm);
+        std::swap(firstHits, historyFirstHits);
+        historyCamera = camera;
+        camera = inCamera;
+        camera.Prepare(width, height);
+        film.Resize(width, height);
+        firstHits.assign(width * height, FirstHit{});
+        if (!hasHistory)
+        {
+            historyFilm.Resize(0, 0);
+            historyFirstHits.clear();
+        }
+        {
+            std::lock_guard<std::mutex> displayLock(displayMutex);
+            displayPixels.assign(width * height, 0);
+        }
+
+        tilesX = (width + kTileSize - 1) / kTileSize;
+        tilesY = (height + kTileSize - 1) / kTileSize;
+        startTime = Clock::now();
+        passIndex = photonMapping ? kPhotonPass : settings.temporalReuse ? kReprojectPass : 0;
+        if (settings.pathGuiding)
+        {
+            guide.Reset();
+            guide.training = settings.guideTrainingPasses > 0;
+        }
+        if (splatting)
+        {
+            bootstrapWeights.assign(kNumBootstrapSamples, 0.0f);
+            splats.Resize(width * height);
+            splatSamplesTaken = 0;
+            splatScale = 0.0f;
+        }
+        if (settings.irradianceCache && irradianceCacheScene != scene)
+        {
+            irradianceCache.Reset();
+            irradianceCacheScene = scene;
+        }
+        if (photonMapping)
+        {
+            photonMap.Reset(settings.photonPaths * (kMaxLightVertices - 2), settings.photonRadius);
+        }
+        if (restir)
+        {
+            // The previous frame's reservoirs stay as history; reprojection sorts out which still apply
+            restirPixels.assign(width * height, RestirPixel{});
+            if (restirHistory.size() != restirPixels.size())
+            {
+                restirHistory.assign(width * height, RestirPixel{});
+            }
+        }
+        passSamples = 1;
+        renderSamplesTaken = 0;
+        outOfTime = false;
+        ++generation;
+        active = width > 0 && height > 0;
+        BeginPass();
+        workCondition.notify_all();
+    }
+
+    // Blocks until every worker is idle. Returns the cancel-to-idle latency in seconds.
+    double Cancel()
+    {
+        const Clock::time_point cancelTime = Clock::now();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (active)
+        {
+            cancelRequested.store(true, std::memory_order_relaxed);
+            nextTile = numTiles;
+            idleCondition.wait(lock, [this] { return busyWorkers == 0; });
+            cancelRequested.store(false, std::memory_order_relaxed);
+            active = false;
+        }
+
+        lastCancelLatency = std::chrono::duration<double>(Clock::now() - cancelTime).count();
+        return lastCancelLatency;
+    }
+
+    void WaitUntilIdle()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idleCondition.wait(lock, [this] { return !active; });
+    }
+
+    bool IsIdle()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return !active;
+    }
+
+    void Present(HDC hdc)
+    {
+        std::lock_guard<std::mutex> displayLock(displayMutex);
+        if (displayPixels.empty())
+        {
+            return;
+        }
+
+        BITMAPINFO bitmapInfo = {};
+        bitmapInfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+        bitmapInfo.bmiHeader.biWidth = film.width;
+        bitmapInfo.bmiHeader.biHeight = -film.height; // Top-down
+        bitmapInfo.bmiHeader.biPlanes = 1;
+        bitmapInfo.bmiHeader.biBitCount = 32;
+        bitmapInfo.bmiHeader.biCompression = BI_RGB;
+        SetDIBitsToDevice(hdc, 0, 0, film.width, film.height, 0, 0, 0, film.height, displayPixels.data(), &bitmapInfo, DIB_RGB_COLORS);
+    }
+
+    void CopyDisplayPixels(std::vector<DWORD>& outPixels)
+    {
+        std::lock_guard<std::mutex> displayLock(displayMutex);
+        outPixels = displayPixels;
+    }
+
+    // Linear radiance of every pixel as displayed, for comparing images. Call while idle.
+    void CopyRadiance(std::vector<Vector3>& outRadiance)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const bool splatting = settings.integrator == Integrator::Metropolis || settings.integrator == Integrator::LightTracing;
+        outRadiance.resize(film.width * film.height);
+        for (int j = 0; j < film.height; ++j)
+        {
+            for (int i = 0; i < film.width; ++i)
+            {
+                const int index = j * film.width + i;
+                outRadiance[index] = splatting ? splats.Get(index) * splatScale : film.Resolve(DisplaySourceIndex(i, j));
+            }
+        }
+    }
+
+    // Samples traced since the last Start: camera samples, Metropolis mutations, or light and photon paths
+    int64_t SamplesTaken()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return renderSamplesTaken;
+    }
+
+    // For callers that modify a scene in place between renders; the next render starts with an empty cache
+    void InvalidateIrradianceCache()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        irradianceCacheScene = nullptr;
+    }
+
+    const Scene& DefaultScene() const
+    {
+        return ownedScene;
+    }
+
+    double lastCancelLatency = 0.0;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static const int kReprojectPass = -1;
+    static const int kPhotonPass = -2;
+
+    // Light subpaths hold the emitter and up to five scattering vertices, the longest paths TracePath finds, plus one
+    // vertex to end the walk
+    static const int kMaxLightVertices = 7;
+    static const int kNumLightBatches = 256;  // Work items per light tracing or photon pass
+
+    // Reservoir resampling: fresh candidates per pixel and pass, neighbors merged per pixel, and the most candidates a
+    // reservoir from the previous pass or frame may count for
+    static const int   kNumLightCandidates = 16;
+    static const int   kNumSpatialNeighbors = 5;
+    static const int   kMaxHistoryCandidates = 20 * kNumLightCandidates;
+    static constexpr float kSpatialRadius = 12.0f; // Pixels
+
+    // Metropolis: the bootstrap pass scores independent primary samples in batches, the next pass starts one chain per
+    // work item, and each later pass advances every chain as a work item
+    static const int kNumBootstrapSamples = 65536;
+    static const int kBootstrapBatchSize = 1024;
+    static const int kNumChains = 1024;
+
+    struct FirstHit
+    {
+        Vector3 position;
+        Vector3 normal;
+        float   depth = -1.0f; // Negative when the center ray escaped or has not been traced
+    };
+
+    // Primary hit and light reservoir of one pixel for Integrator::Restir
+    struct RestirPixel
+    {
+        ShadingPoint   surface;
+        Vector3        radiance{ 0.0f }; // Emission, or the whole pixel value when there is no reservoir
+        float          depth = -1.0f;    // Negative for pixels without a diffuse primary hit, which have no reservoir
+        LightReservoir reservoir;
+    };
+
+    struct MarkovChain
+    {
+        MltSampler sampler;
+        Random     random;             // Acceptance decisions
+        Vector3    radiance{ 0.0f };   // Contribution of the current state and where it lands on the film
+        float      x = 0.0f;
+        float      y = 0.0f;
+    };
+
+    double ElapsedSeconds() const
+    {
+        return std::chrono::duration<double>(Clock::now() - startTime).count();
+    }
+
+    // Called with the mutex held
+    void BeginPass()
+    {
+        passStartTime = Clock::now();
+        passPixelsSampled = 0;
+        passSamplesTaken = 0;
+        if (settings.integrator == Integrator::Metropolis)
+        {
+            numTiles = passIndex == 0 ? kNumBootstrapSamples / kBootstrapBatchSize : kNumChains;
+        }
+        else if (settings.integrator == Integrator::LightTracing || passIndex == kPhotonPass)
+        {
+            numTiles = kNumLightBatches;
+        }
+        else
+        {
+            numTiles = tilesX * tilesY;
+        }
+        nextTile = 0;
+        tilesDone = 0;
+    }
+
+    // Called with the mutex held by the worker that completed the last tile of a pass. Sizes the next pass from the
+    // measured cost per sample so that the last pass finishes close to the deadline, or ends the render.
+    void EndPass()
+    {
+        if (settings.pathGuiding && guide.training)
+        {
+            guide.Update();
+            guide.training = passIndex + 1 < settings.guideTrainingPasses;
+        }
+        if (settings.irradianceCache)
+        {
+            irradianceCache.Update();
+        }
+
+        if (settings.integrator == Integrator::Metropolis)
+        {
+            EndMetropolisPass();
+            return;
+        }
+        if (settings.integrator == Integrator::LightTracing)
+        {
+            FinishPass(ResolveSplats(1.0) || outOfTime);
+            return;
+        }
+        if (settings.integrator == Integrator::Restir)
+        {
+            // Every odd pass completes one sample per pixel, and the next even pass reprojects into its view
+            const bool shaded = (passIndex & 1) != 0;
+            if (shaded)
+            {
+                historyCamera = camera;
+            }
+            FinishPass(outOfTime || (shaded && (passIndex + 1) / 2 >= settings.maxSamplesPerPixel));
+            return;
+        }
+
+        // With the photon map complete, rendering starts at the coarsest preview level
+        if (passIndex == kPhotonPass)
+        {
+            photonMap.numPaths = passSamplesTaken;
+            passIndex = 0;
+            BeginPass();
+            workCondition.notify_all();
+            return;
+        }
+
+        // Preview levels always run to completion; coarse levels may sample nothing on tiny images
+        if (passIndex < kNumPreviewLevels - 1)
+        {
+            ++passIndex;
+            BeginPass();
+            workCondition.notify_all();
+            return;
+        }
+
+        bool finished = passSamplesTaken == 0 || outOfTime;
+        if (!finished)
+        {
+            const double passSeconds = std::chrono::duration<double>(Clock::now() - passStartTime).count();
+            const double secondsPerSample = passSeconds / static_cast<double>(passSamplesTaken);
+            passSamples = settings.samplesPerPass;
+
+            if (settings.timeBudgetSeconds > 0.0)
+            {
+                const double remaining = settings.timeBudgetSeconds - ElapsedSeconds();
+                const double affordable = remaining / (secondsPerSample * static_cast<double>(passPixelsSampled));
+                finished = affordable < 1.0;
+                passSamples = std::min(passSamples, std::max(1, static_cast<int>(affordable)));
+            }
+        }
+
+        FinishPass(finished);
+    }
+
+    // Ends the render or starts the next pass. Called with the mutex held.
+    void FinishPass(bool finished)
+    {
+        if (finished)
+        {
+            active = false;
+            idleCondition.notify_all();
+        }
+        else
+        {
+            ++passIndex;
+            BeginPass();
+            workCondition.notify_all();
+        }
+    }
+
+    void WorkerMain()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            workCondition.wait(lock, [this] { return shutdown || (active && nextTile < numTiles); });
+            if (shutdown)
+            {
+                return;
+            }
+
+            const int tile = nextTile++;
+            const int pass = passIndex;
+            const int samples = passSamples;
+            const uint32_t seed = HashUint(generation) ^ HashUint(static_cast<uint32_t>(pass * numTiles + tile));
+            ++busyWorkers;
+            lock.unlock();
+
+            int pixelsSampled = 0;
+            int samplesTaken = 0;
+            if (settings.integrator == Integrator::Metropolis)
+            {
+                RunMetropolis(tile, pass, samplesTaken);
+            }
+            else if (settings.integrator == Integrator::LightTracing)
+            {
+                TraceLightPaths(seed, samplesTaken);
+            }
+            else if (pass == kPhotonPass)
+            {
+                TracePhotons(seed, samplesTaken);
+            }
+            else if (settings.integrator == Integrator::Restir)
+            {
+                RestirTile(tile, pass, seed, samplesTaken);
+            }
+            else
+            {
+                RenderTile(tile, pass, samples, seed, pixelsSampled, samplesTaken);
+            }
+
+            lock.lock();
+            --busyWorkers;
+            passPixelsSampled += pixelsSampled;
+            passSamplesTaken += samplesTaken;
+            renderSamplesTaken += samplesTaken;
+            ++tilesDone;
+
+            if (cancelRequested.load(std::memory_order_relaxed))
+            {
+                if (busyWorkers == 0)
+                {
+                    idleCondition.notify_all();
+                }
+            }
+            else if (tilesDone == numTiles)
+            {
+                EndPass();
+            }
+        }
+    }
+
+    // The bootstrap seeds are replayed to start the chains, so they depend only on the render and sample index
+    uint32_t BootstrapSeed(int sample) const
+    {
+        return HashUint(generation) ^ static_cast<uint32_t>(sample);
+    }
+
+    int SplatIndex(float x, float y) const
+    {
+        const int i = std::min(std::max(static_cast<int>(floorf(x + 0.5f)), 0), film.width - 1);
+        const int j = std::min(std::max(static_cast<int>(floorf(y + 0.5f)), 0), film.height - 1);
+        return j * film.width + i;
+    }
+
+    // Pass 0 scores one batch of bootstrap samples, pass 1 starts one chain and later passes advance one chain
+    void RunMetropolis(int item, int pass, int& outSamplesTaken)
+    {
+        if (settings.timeBudgetSeconds > 0.0 && ElapsedSeconds() >= settings.timeBudgetSeconds)
+        {
+            outOfTime = true;
+            return;
+        }
+
+        float x;
+        float y;
+        if (pass == 0)
+        {
+            for (int i = item * kBootstrapBatchSize; i < (item + 1) * kBootstrapBatchSize; ++i)
+            {
+                if (cancelRequested.load(std::memory_order_relaxed))
+                {
+                    return;
+                }
+
+                MltSampler sampler(BootstrapSeed(i));
+                bootstrapWeights[i] = Luminance(TracePrimarySample(*scene, camera, film.width, film.height, sampler, x, y));
+                ++outSamplesTaken;
+            }
+            return;
+        }
+
+        MarkovChain& chain = chains[item];
+        if (pass == 1)
+        {
+            // Replaying the seed reproduces the bootstrap path and leaves the sampler holding its coordinates
+            chain.radiance = TracePrimarySample(*scene, camera, film.width, film.height, chain.sampler, chain.x, chain.y);
+            ++outSamplesTaken;
+            return;
+        }
+
+        for (int m = 0; m < mutationsPerChain; ++m)
+        {
+            if (cancelRequested.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+
+            chain.sampler.StartIteration();
+            const Vector3 proposed = TracePrimarySample(*scene, camera, film.width, film.height, chain.sampler, x, y);
+            const float proposedLuminance = Luminance(proposed);
+            const float currentLuminance = Luminance(chain.radiance);
+            const float accept = currentLuminance > 0.0f ? std::min(1.0f, proposedLuminance / currentLuminance) : 1.0f;
+
+            // Both states are splatted weighted by their acceptance probability, so rejected proposals still count
+            if (accept > 0.0f && proposedLuminance > 0.0f)
+            {
+                splats.Add(SplatIndex(x, y), proposed * (accept / proposedLuminance));
+            }
+            if (accept < 1.0f)
+            {
+                splats.Add(SplatIndex(chain.x, chain.y), chain.radiance * ((1.0f - accept) / currentLuminance));
+            }
+
+            if (chain.random.NextFloat() < accept)
+            {
+                chain.radiance = proposed;
+                chain.x = x;
+                chain.y = y;
+                chain.sampler.Accept();
+            }
+            else
+            {
+                chain.sampler.Reject();
+            }
+            ++outSamplesTaken;
+        }
+    }
+
+    // Called from EndPass. The bootstrap's mean luminance normalizes the splats, and each chain is seeded with a bootstrap
+    // sample picked in proportion to its luminance, so no burn-in is needed; the next pass traces the chains' starting
+    // states. Mutation passes publish the splatted image; the render ends once the mutations
+    // amount to the sample limit of every pixel.
+    void EndMetropolisPass()
+    {
+        const int numPixels = film.width * film.height;
+        bool finished = outOfTime;
+        if (passIndex == 0)
+        {
+            std::vector<float> cdf(kNumBootstrapSamples);
+            double total = 0.0;
+            for (int i = 0; i < kNumBootstrapSamples; ++i)
+            {
+                total += bootstrapWeights[i];
+                cdf[i] = static_cast<float>(total);
+            }
+            normalization = total / static_cast<double>(kNumBootstrapSamples);
+            finished = finished || normalization <= 0.0;
+
+            chains.clear();
+            if (!finished)
+            {
+                Random random(HashUint(generation));
+                chains.reserve(kNumChains);
+                for (int c = 0; c < kNumChains; ++c)
+                {
+                    const float target = random.NextFloat() * cdf.back();
+                    const int sample = std::min(static_cast<int>(std::upper_bound(cdf.begin(), cdf.end(), target) - cdf.begin()), kNumBootstrapSamples - 1);
+                    chains.push_back(MarkovChain{ MltSampler(BootstrapSeed(sample)), Random(HashUint(generation) ^ HashUint(static_cast<uint32_t>(c))) });
+                }
+                mutationsPerChain = std::max(1, static_cast<int>(static_cast<int64_t>(numPixels) * settings.samplesPerPass / kNumChains));
+            }
+        }
+        else if (passIndex > 1)
+        {
+            finished = ResolveSplats(normalization) || finished;
+        }
+
+        FinishPass(finished);
+    }
+
+    // Displays the splat film, with each splat sample counting as one sample spread over the whole image and scaled by
+    // weight. Returns whether the samples per pixel are used up.
+    bool ResolveSplats(double weight)
+    {
+        const int numPixels = film.width * film.height;
+        splatSamplesTaken += static_cast<uint64_t>(passSamplesTaken);
+
+        if (splatSamplesTaken > 0)
+        {
+            splatScale = static_cast<float>(weight * static_cast<double>(numPixels) / static_cast<double>(splatSamplesTaken));
+            std::lock_guard<std::mutex> displayLock(displayMutex);
+            for (int i = 0; i < numPixels; ++i)
+            {
+                displayPixels[i] = ToDisplayPixel(splats.Get(i) * splatScale);
+            }
+        }
+        return passSamplesTaken == 0 || splatSamplesTaken >= static_cast<uint64_t>(settings.maxSamplesPerPixel) * static_cast<uint64_t>(numPixels);
+    }
+
+    // Light tracing: each light path is connected to the camera at every vertex, splatting into the shared splat film.
+    // A pass traces samplesPerPass paths per pixel over all its work items.
+    void TraceLightPaths(uint32_t seed, int& outSamplesTaken)
+    {
+        if (settings.timeBudgetSeconds > 0.0 && ElapsedSeconds() >= settings.timeBudgetSeconds)
+        {
+            outOfTime = true;
+            return;
+        }
+
+        const int64_t passPaths = static_cast<int64_t>(film.width) * film.height * settings.samplesPerPass;
+        const int numPaths = static_cast<int>((passPaths + kNumLightBatches - 1) / kNumLightBatches);
+        Random random(seed);
+        BdptVertex vertices[kMaxLightVertices];
+        for (int p = 0; p < numPaths; ++p)
+        {
+            if (cancelRequested.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+
+            const float time = camera.shutterClose > camera.shutterOpen ? Lerp(camera.shutterOpen, camera.shutterClose, random.NextFloat()) : camera.shutterOpen;
+            const int numVertices = LightPathLength(GenerateLightSubpath(*scene, time, random, vertices, kMaxLightVertices));
+            for (int v = 0; v < numVertices; ++v)
+            {
+                float x;
+                float y;
+                const Vector3 contribution = ConnectToCamera(*scene, camera, vertices[v], time, x, y);
+                if (contribution.Dot(Vector3{ 1.0f }) > 0.0f && x >= -0.5f && y >= -0.5f &&
+                    x < static_cast<float>(film.width) - 0.5f && y < static_cast<float>(film.height) - 0.5f)
+                {
+                    splats.Add(SplatIndex(x, y), contribution);
+                }
+            }
+            ++outSamplesTaken;
+        }
+    }
+
+    // Traces this work item's share of the photon paths into the photon map. Past the deadline the map is left with
+    // the paths traced so far, which it is normalized by, and the preview pyramid still runs.
+    void TracePhotons(uint32_t seed, int& outSamplesTaken)
+    {
+        if (settings.timeBudgetSeconds > 0.0 && ElapsedSeconds() >= settings.timeBudgetSeconds)
+        {
+            outOfTime = true;
+            return;
+        }
+
+        const int numPaths = (settings.photonPaths + kNumLightBatches - 1) / kNumLightBatches;
+        Random random(seed);
+        BdptVertex vertices[kMaxLightVertices];
+        for (int p = 0; p < numPaths; ++p)
+        {
+            if (cancelRequested.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+
+            const float time = camera.shutterClose > camera.shutterOpen ? Lerp(camera.shutterOpen, camera.shutterClose, random.NextFloat()) : camera.shutterOpen;
+            const int numVertices = LightPathLength(GenerateLightSubpath(*scene, time, random, vertices, kMaxLightVertices));
+            for (int v = 1; v < numVertices; ++v)
+            {
+                if (!vertices[v].delta)
+                {
+                    photonMap.Add(vertices[v].position, (vertices[v - 1].position - vertices[v].position).Normalize(), vertices[v].beta);
+                }
+            }
+            ++outSamplesTaken;
+        }
+    }
+
+    // A walk that stopped at kMaxLightVertices did not scatter at its last vertex, so that vertex is left out
+    static int LightPathLength(int numVertices)
+    {
+        return numVertices == kMaxLightVertices ? numVertices - 1 : numVertices;
+    }
+
+    Vector3 Trace(const Ray& ray, Random& random)
+    {
+        switch (settings.integrator)
+        {
+        case Integrator::Preview:
+            return TraceDirect(ray, *scene, random);
+        case Integrator::Bidirectional:
+            return TraceBidirectional(ray, *scene, random);
+        case Integrator::PhotonMap:
+            return TracePhotonMapped(ray, *scene, random, photonMap);
+        default:
+            return TracePath(ray, *scene, random, settings.pathGuiding ? &guide : nullptr, settings.irradianceCache ? &irradianceCache : nullptr);
+        }
+    }
+
+    void RenderTile(int tile, int pass, int samples, uint32_t seed, int& outPixelsSampled, int& outSamplesTaken)
+    {
+        const int x0 = (tile % tilesX) * kTileSize;
+        const int y0 = (tile / tilesX) * kTileSize;
+        const int x1 = std::min(x0 + kTileSize, film.width);
+        const int y1 = std::min(y0 + kTileSize, film.height);
+
+        // The preview passes are never cut short by the deadline so that some full-resolution image always exists
+        const bool budgeted = pass >= kNumPreviewLevels && settings.timeBudgetSeconds > 0.0;
+        if (budgeted && ElapsedSeconds() >= settings.timeBudgetSeconds)
+        {
+            outOfTime = true;
+            return;
+        }
+
+        if (pass == kReprojectPass)
+        {
+            ReprojectTile(x0, y0, x1, y1);
+            ResolveTile(x0, y0, x1, y1);
+            return;
+        }
+
+        const int step = pass < kNumPreviewLevels ? kPreviewSteps[pass] : 1;
+
+        // Collect the pixels that still need samples, then generate and trace one batch of camera rays per sample index
+        alignas(16) float pixelX[RayBatch::kMaxRays];
+        alignas(16) float pixelY[RayBatch::kMaxRays];
+        int pixelIndex[RayBatch::kMaxRays];
+        int pixelSamples[RayBatch::kMaxRays];
+        int numPixels = 0;
+        int maxPixelSamples = 0;
+        for (int j = y0; j < y1; j += step)
+        {
+            for (int i = x0; i < x1; i += step)
+            {
+                const int index = j * film.width + i;
+                if (film.IsConverged(index, settings) || (pass < kNumPreviewLevels && film.sampleCount[index] > 0))
+                {
+                    continue;
+                }
+
+                pixelX[numPixels] = static_cast<float>(i);
+                pixelY[numPixels] = static_cast<float>(j);
+                pixelIndex[numPixels] = index;
+                pixelSamples[numPixels] = std::min(samples, settings.maxSamplesPerPixel - film.sampleCount[index]);
+                maxPixelSamples = std::max(maxPixelSamples, pixelSamples[numPixels]);
+                ++numPixels;
+            }
+        }
+
+        Random random(seed);
+        RandomLanes rayRandom(seed);
+        RayBatch rays;
+        for (int s = 0; s < maxPixelSamples; ++s)
+        {
+            // A tile can hold many samples per pixel, so the deadline is checked again before every batch. The samples
+            // already taken are kept and resolved.
+            if (s > 0 && budgeted && ElapsedSeconds() >= settings.timeBudgetSeconds)
+            {
+                outOfTime = true;
+                break;
+            }
+
+            // Compact away pixels that already have all of this pass's samples
+            int batchSize = 0;
+            for (int p = 0; p < numPixels; ++p)
+            {
+                if (pixelSamples[p] > s)
+                {
+                    pixelX[batchSize] = pixelX[p];
+                    pixelY[batchSize] = pixelY[p];
+                    pixelIndex[batchSize] = pixelIndex[p];
+                    pixelSamples[batchSize] = pixelSamples[p];
+                    ++batchSize;
+                }
+            }
+            numPixels = batchSize;
+
+            camera.GenerateRays(pixelX, pixelY, numPixels, rayRandom, rays);
+            for (int p = 0; p < numPixels; ++p)
+            {
+                if (cancelRequested.load(std::memory_order_relaxed))
+                {
+                    return;
+                }
+
+                const Ray ray = rays.Get(p);
+                film.AddSample(pixelIndex[p], Trace(ray, random));
+                ++outSamplesTaken;
+            }
+            if (s == 0)
+            {
+                outPixelsSampled += numPixels;
+            }
+        }
+
+        ResolveTile(x0, y0, x1, y1);
+    }
+
+    // Even passes find every pixel's primary hit, draw fresh light candidates into its reservoir and merge in the
+    // reservoir its surface had in the previous pass or frame. Odd passes merge the reservoirs of similar surfaces
+    // nearby, then shade each pixel with the light sample that survives and keep its reservoir as history.
+    void RestirTile(int tile, int pass, uint32_t seed, int& outSamplesTaken)
+    {
+        const int x0 = (tile % tilesX) * kTileSize;
+        const int y0 = (tile / tilesX) * kTileSize;
+        const int x1 = std::min(x0 + kTileSize, film.width);
+        const int y1 = std::min(y0 + kTileSize, film.height);
+
+        if (settings.timeBudgetSeconds > 0.0 && ElapsedSeconds() >= settings.timeBudgetSeconds)
+        {
+            outOfTime = true;
+            return;
+        }
+
+        Random random(seed);
+        for (int j = y0; j < y1; ++j)
+        {
+            if (cancelRequested.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+
+            for (int i = x0; i < x1; ++i)
+            {
+                if ((pass & 1) == 0)
+                {
+                    GenerateReservoir(i, j, random);
+                }
+                else
+                {
+                    film.AddSample(j * film.width + i, ResampleNeighbors(i, j, random));
+                    ++outSamplesTaken;
+                }
+            }
+        }
+
+        if ((pass & 1) != 0)
+        {
+            ResolveTile(x0, y0, x1, y1);
+        }
+    }
+
+    void GenerateReservoir(int i, int j, Random& random)
+    {
+        RestirPixel& pixel = restirPixels[j * film.width + i];
+        pixel = RestirPixel{};
+
+        const float time = camera.shutterClose > camera.shutterOpen ? Lerp(camera.shutterOpen, camera.shutterClose, random.NextFloat()) : camera.shutterOpen;
+        const float x = static_cast<float>(i) + random.NextFloat() - 0.5f;
+        const float y = static_cast<float>(j) + random.NextFloat() - 0.5f;
+        const float lensRand0 = random.NextFloat();
+        const float lensRand1 = random.NextFloat();
+        const Ray ray = camera.GenerateRay(x, y, lensRand0, lensRand1, time);
+
+        // Sky, mirrors and glass are shaded by the preview integrator instead
+        Hit hit;
+        if (!IntersectScene(ray, *scene, hit) || scene->materials.types[scene->spheres[hit.sphereIndex].material] != MaterialType::Diffuse)
+        {
+            pixel.radiance = TraceDirect(ray, *scene, random);
+            return;
+        }
+
+        pixel.surface = ShadingPoint{ hit.position, hit.normal, SurfaceAlbedo(*scene, ray, hit), hit.sphereIndex, time, hit.positionError };
+        pixel.radiance = scene->materials.emissive[scene->spheres[hit.sphereIndex].material];
+        pixel.depth = hit.distance;
+
+        // Candidates are uniform points on uniformly chosen emitters, with the points drawn for all of them at once
+        float normalRand0[kNumLightCandidates];
+        float normalRand1[kNumLightCandidates];
+        for (int c = 0; c < kNumLightCandidates; ++c)
+        {
+            normalRand0[c] = random.NextFloat();
+            normalRand1[c] = random.NextFloat();
+        }
+        Vector3 lightNormals[kNumLightCandidates];
+        RandomSphereVectors(normalRand0, normalRand1, kNumLightCandidates, lightNormals);
+
+        LightReservoir& reservoir = pixel.reservoir;
+        const int numLights = static_cast<int>(scene->lights.size());
+        for (int c = 0; c < kNumLightCandidates; ++c)
+        {
+            const int light = scene->lights[std::min(static_cast<int>(random.NextFloat() * static_cast<float>(numLights)), numLights - 1)];
+            const Vector3& lightNormal = lightNormals[c];
+            const float radius = scene->spheres[light].radius;
+            Vector3 direction;
+            float distance;
+            const float targetPdf = Luminance(UnshadowedLight(*scene, pixel.surface, light, lightNormal, direction, distance));
+            reservoir.Update(light, lightNormal, targetPdf * static_cast<float>(numLights) * 4.0f * kPi * radius * radius, targetPdf, random.NextFloat());
+        }
+        reservoir.count = kNumLightCandidates;
+
+        // The same surface in the previous pass or frame, found and validated as temporal reuse does for radiance
+        float prevX;
+        float prevY;
+        if (!historyCamera.Project(hit.position, prevX, prevY))
+        {
+            return;
+        }
+
+        const int prevI = static_cast<int>(floorf(prevX + 0.5f));
+        const int prevJ = static_cast<int>(floorf(prevY + 0.5f));
+        if (prevI < 0 || prevJ < 0 || prevI >= film.width || prevJ >= film.height)
+        {
+            return;
+        }
+
+        const RestirPixel& previous = restirHistory[prevJ * film.width + prevI];
+        const float expectedDepth = hit.position.Distance(historyCamera.position);
+        if (previous.depth < 0.0f || previous.reservoir.light < 0 || previous.reservoir.light >= static_cast<int>(scene->spheres.size()) ||
+            fabsf(expectedDepth - previous.depth) > settings.temporalDepthTolerance * previous.depth ||
+            hit.normal.Dot(previous.surface.normal) < settings.temporalNormalTolerance)
+        {
+            return;
+        }
+
+        Vector3 direction;
+        float distance;
+        const float targetPdf = Luminance(UnshadowedLight(*scene, pixel.surface, previous.reservoir.light, previous.reservoir.lightNormal, direction, distance));
+        reservoir.Merge(previous.reservoir, targetPdf, kMaxHistoryCandidates, random.NextFloat());
+    }
+
+    // Neighbors are trusted whenever their surfaces look alike, without checking that they could have produced each
+    // other's samples, which trades a little bias for far less noise
+    Vector3 ResampleNeighbors(int i, int j, Random& random)
+    {
+        const int index = j * film.width + i;
+        const RestirPixel& pixel = restirPixels[index];
+        RestirPixel& output = restirHistory[index];
+        output = pixel;
+        if (pixel.depth < 0.0f)
+        {
+            return pixel.radiance;
+        }
+
+        LightReservoir& reservoir = output.reservoir;
+        Vector3 direction;
+        float distance;
+        for (int n = 0; n < kNumSpatialNeighbors; ++n)
+        {
+            const float radius = kSpatialRadius * sqrtf(random.NextFloat());
+            float sinAngle;
+            float cosAngle;
+            SinCos2Pi(random.NextFloat(), sinAngle, cosAngle);
+            const int neighborI = i + static_cast<int>(floorf(radius * cosAngle + 0.5f));
+            const int neighborJ = j + static_cast<int>(floorf(radius * sinAngle + 0.5f));
+            if (neighborI < 0 || neighborJ < 0 || neighborI >= film.width || neighborJ >= film.height || (neighborI == i && neighborJ == j))
+            {
+                continue;
+            }
+
+            const RestirPixel& neighbor = restirPixels[neighborJ * film.width + neighborI];
+            if (neighbor.depth < 0.0f || neighbor.reservoir.light < 0 ||
+                fabsf(neighbor.depth - pixel.depth) > settings.temporalDepthTolerance * pixel.depth ||
+                neighbor.surface.normal.Dot(pixel.surface.normal) < settings.temporalNormalTolerance)
+            {
+                continue;
+            }
+
+            const float targetPdf = Luminance(UnshadowedLight(*scene, pixel.surface, neighbor.reservoir.light, neighbor.reservoir.lightNormal, direction, distance));
+            reservoir.Merge(neighbor.reservoir, targetPdf, INT_MAX, random.NextFloat());
+        }
+
+        if (reservoir.light < 0)
+        {
+            return pixel.radiance;
+        }
+
+        // An occluded sample is also dropped from the history, so that shadowed pixels stop passing it on
+        const Vector3 light = UnshadowedLight(*scene, pixel.surface, reservoir.light, reservoir.lightNormal, direction, distance);
+        const ShadingPoint& surface = pixel.surface;
+        if (IsOccluded(Ray{ OffsetRayOrigin(surface.position, surface.positionError, surface.normal, direction), direction, surface.time }, *scene, distance * 0.999f))
+        {
+            reservoir.weightSum = 0.0f;
+            return pixel.radiance;
+        }
+        return pixel.radiance + light * reservoir.ContributionWeight();
+    }
+
+    // Fills the first-hit buffer for the tile and seeds pixels whose surface was also visible in the previous frame
+    void ReprojectTile(int x0, int y0, int x1, int y1)
+    {
+        const bool hasHistory = !historyFirstHits.empty();
+        for (int j = y0; j < y1; ++j)
+        {
+            if (cancelRequested.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+
+            for (int i = x0; i < x1; ++i)
+            {
+                const int index = j * film.width + i;
+                Hit hit;
+                if (!IntersectScene(camera.GenerateRay(static_cast<float>(i), static_cast<float>(j)), *scene, hit))
+                {
+                    continue;
+                }
+
+                FirstHit& firstHit = firstHits[index];
+                firstHit.position = hit.position;
+                firstHit.normal = hit.normal;
+                firstHit.depth = hit.distance;
+
+                float prevX;
+                float prevY;
+                if (!hasHistory || !historyCamera.Project(hit.position, prevX, prevY))
+                {
+                    continue;
+                }
+
+                const int prevI = static_cast<int>(floorf(prevX + 0.5f));
+                const int prevJ = static_cast<int>(floorf(prevY + 0.5f));
+                if (prevI < 0 || prevJ < 0 || prevI >= film.width || prevJ >= film.height)
+                {
+                    continue;
+                }
+
+                const int prevIndex = prevJ * film.width + prevI;
+                const FirstHit& prevHit = historyFirstHits[prevIndex];
+                if (prevHit.depth < 0.0f || historyFilm.sampleCount[prevIndex] == 0)
+                {
+                    continue;
+                }
+
+                // Depth as seen from the previous camera must match what that pixel recorded, or the point was hidden
+                const float expectedDepth = hit.position.Distance(historyCamera.position);
+                if (fabsf(expectedDepth - prevHit.depth) > settings.temporalDepthTolerance * prevHit.depth ||
+                    hit.normal.Dot(prevHit.normal) < settings.temporalNormalTolerance)
+                {
+                    continue;
+                }
+
+                film.CopyHistory(index, historyFilm, prevIndex, settings.temporalHistoryLimit);
+            }
+        }
+    }
+
+    // Pixels without samples of their own are filled from the finest sampled preview block containing them
+    int DisplaySourceIndex(int i, int j) const
+    {
+        for (int level = kNumPreviewLevels - 1; level >= 0; --level)
+        {
+            const int mask = ~(kPreviewSteps[level] - 1);
+            const int index = (j & mask) * film.width + (i & mask);
+            if (film.sampleCount[index] > 0)
+            {
+                return index;
+            }
+        }
+        return j * film.width + i;
+    }
+
+    void ResolveTile(int x0, int y0, int x1, int y1)
+    {
+        std::lock_guard<std::mutex> displayLock(displayMutex);
+        for (int j = y0; j < y1; ++j)
+        {
+            for (int i = x0; i < x1; ++i)
+            {
+                const int index = j * film.width + i;
+                displayPixels[index] = ToDisplayPixel(film.Resolve(DisplaySourceIndex(i, j)));
+            }
+        }
+    }
+
+    static DWORD ToDisplayPixel(const Vector3& color)
+    {
+        return RGB(static_cast<BYTE>(Saturate(color.z) * 255.0f), static_cast<BYTE>(Saturate(color.y) * 255.0f), static_cast<BYTE>(Saturate(color.x) * 255.0f));
+    }
+
+    Scene                    ownedScene;
+    const Scene*             scene = &ownedScene;
+    std::vector<std::thread> workers;
+
+    // Render state; guarded by mutex except where workers own a tile of the film
+    std::mutex              mutex;
+    std::condition_variable workCondition;
+    std::condition_variable idleCondition;
+    std::atomic<bool>       cancelRequested{ false };
+    std::atomic<bool>       outOfTime{ false };
+    bool                    shutdown = false;
+    bool                    active = false;
+    uint32_t                generation = 0;
+    RenderSettings          settings;
+    Camera                  camera = DefaultCamera();
+    Film                    film;
+    std::vector<FirstHit>   firstHits;
+    Camera                  historyCamera = DefaultCamera();
+    Film                    historyFilm;
+    std::vector<FirstHit>   historyFirstHits;
+    PathGuide               guide;
+    IrradianceCache         irradianceCache;
+    const Scene*            irradianceCacheScene = nullptr; // Scene the cache was filled for
+    Clock::time_point       startTime;
+    Clock::time_point       passStartTime;
+    int                     tilesX = 0;
+    int                     tilesY = 0;
+    int                     numTiles = 0;
+    int                     nextTile = 0;
+    int                     tilesDone = 0;
+    int                     busyWorkers = 0;
+    int                     passIndex = 0;
+    int                     passSamples = 1;
+    int                     passPixelsSampled = 0;
+    int                     passSamplesTaken = 0;
+    int64_t                 renderSamplesTaken = 0; // Over all passes since Start
+
+    // Splatting state
+    std::vector<float>       bootstrapWeights;
+    std::vector<MarkovChain> chains;
+    SplatFilm                splats;
+    double                   normalization = 0.0;
+    uint64_t                 splatSamplesTaken = 0; // Metropolis mutations or light paths
+    float                    splatScale = 0.0f;     // From splat sums to radiance, as last displayed
+    int                      mutationsPerChain = 1;
+    PhotonMap                photonMap;
+    std::vector<RestirPixel> restirPixels;  // This pass's primary hits and reservoirs
+    std::vector<RestirPixel> restirHistory; // Shaded reservoirs of the previous pass or frame
+
+    std::mutex         displayMutex;
+    std::vector<DWORD> displayPixels;
+};
+
+// Thread-safe FIFO that blocks producers while full, so a slow consumer throttles rendering instead of growing memory
+template< typename T >
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t inCapacity)
+        : capacity(inCapacity)
+    {}
+
+    void Push(T&& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    // Returns false once the queue has been closed and drained
+    bool Pop(T& outItem)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty())
+        {
+            return false;
+        }
+
+        outItem = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t                  capacity;
+    std::deque<T>           items;
+    bool                    closed = false;
+    std::mutex              mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+};
+
+class Frame
+{
+public:
+    int                index = 0;
+    int                width = 0;
+    int                height = 0;
+    std::vector<DWORD> pixels; // 0x00RRGGBB, top-down
+};
+
+using FrameWriter = std::function<void(const Frame& frame)>;
+
+bool WritePpm(const char* path, const Frame& frame)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    std::vector<BYTE> rgb(frame.pixels.size() * 3);
+    for (size_t i = 0; i < frame.pixels.size(); ++i)
+    {
+        rgb[i * 3 + 0] = static_cast<BYTE>(frame.pixels[i] >> 16);
+        rgb[i * 3 + 1] = static_cast<BYTE>(frame.pixels[i] >> 8);
+        rgb[i * 3 + 2] = static_cast<BYTE>(frame.pixels[i]);
+    }
+
+    fprintf(file, "P6\n%d %d\n255\n", frame.width, frame.height);
+    bool success = fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+    return fclose(file) == 0 && success;
+}
+
+// Writes each frame to its own PPM file named from a printf-style pattern such as "frame_%04d.ppm"
+FrameWriter PpmSequenceWriter(const std::string& pattern)
+{
+    return [pattern](const Frame& frame)
+    {
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), pattern.c_str(), frame.index);
+        if (!WritePpm(path, frame))
+        {
+            OutputDebugStringA("SoftPT: failed to write sequence frame\n");
+        }
+    };
+}
+
+// BT.601 limited-range RGB to YUV 4:4:4. SSE2 converts four pixels per iteration: each pixel's B, G, R bytes are
+// widened to 16 bits so one _mm_madd_epi16 per channel pair computes two partial dot products per pixel.
+void ConvertToYuv444(const DWORD* pixels, int count, BYTE* outY, BYTE* outU, BYTE* outV)
+{
+    // Coefficients in B, G, R, A order, matching the in-memory layout of 0x00RRGGBB pixels
+    const __m128i yCoeffs = _mm_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0);
+    const __m128i uCoeffs = _mm_setr_epi16(112, -74, -38, 0, 112, -74, -38, 0);
+    const __m128i vCoeffs = _mm_setr_epi16(-18, -94, 112, 0, -18, -94, 112, 0);
+    const __m128i rounding = _mm_set1_epi32(128);
+    const __m128i yOffset = _mm_set1_epi32(16);
+    const __m128i uvOffset = _mm_set1_epi32(128);
+    const __m128i zero = _mm_setzero_si128();
+
+    auto dotProducts = [](__m128i lo, __m128i hi, __m128i coeffs)
+    {
+        // Each madd yields (b*cb + g*cg, r*cr) pairs for two pixels; add the pair halves to get one sum per pixel
+        __m128 pairsLo = _mm_castsi128_ps(_mm_madd_epi16(lo, coeffs));
+        __m128 pairsHi = _mm_castsi128_ps(_mm_madd_epi16(hi, coeffs));
+        __m128i even = _mm_castps_si128(_mm_shuffle_ps(pairsLo, pairsHi, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i odd = _mm_castps_si128(_mm_shuffle_ps(pairsLo, pairsHi, _MM_SHUFFLE(3, 1, 3, 1)));
+        return _mm_add_epi32(even, odd);
+    };
+
+    auto storeBytes = [&zero](BYTE* dest, __m128i values)
+    {
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(values, zero), zero);
+        int packed = _mm_cvtsi128_si32(bytes);
+        memcpy(dest, &packed, 4);
+    };
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i bgra = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+        __m128i lo = _mm_unpacklo_epi8(bgra, zero);
+        __m128i hi = _mm_unpackhi_epi8(bgra, zero);
+
+        __m128i y = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(dotProducts(lo, hi, yCoeffs), rounding), 8), yOffset);
+        __m128i u = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(dotProducts(lo, hi, uCoeffs), rounding), 8), uvOffset);
+        __m128i v = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(dotProducts(lo, hi, vCoeffs), rounding), 8), uvOffset);
+
+        storeBytes(outY + i, y);
+        storeBytes(outU + i, u);
+        storeBytes(outV + i, v);
+    }
+
+    for (; i < count; ++i)
+    {
+        int r = (pixels[i] >> 16) & 0xff;
+        int g = (pixels[i] >> 8) & 0xff;
+        int b = pixels[i] & 0xff;
+        outY[i] = static_cast<BYTE>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        outU[i] = static_cast<BYTE>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        outV[i] = static_cast<BYTE>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+}
+
+// Streams frames as YUV4MPEG2 to a file, or to stdout when the path is "-", so an encoder such as ffmpeg can read
+// them from a pipe without intermediate images. Writer threads convert frames in parallel; output is serialized in
+// frame order, with frames that finish early held back until their predecessors have been written.
+class Y4mStreamWriter
+{
+public:
+    Y4mStreamWriter(const char* path, int inFramesPerSecond)
+        : framesPerSecond(inFramesPerSecond)
+    {
+        if (strcmp(path, "-") == 0)
+        {
+            _setmode(_fileno(stdout), _O_BINARY);
+            file = stdout;
+        }
+        else
+        {
+            file = fopen(path, "wb");
+            ownsFile = true;
+        }
+    }
+
+    ~Y4mStreamWriter()
+    {
+        if (ownsFile && file != nullptr)
+        {
+            fclose(file);
+        }
+        else if (file != nullptr)
+        {
+            fflush(file);
+        }
+    }
+
+    bool IsOpen() const
+    {
+        return file != nullptr;
+    }
+
+    void Write(const Frame& frame)
+    {
+        const int numPixels = frame.width * frame.height;
+        std::vector<BYTE> planes(numPixels * 3);
+        ConvertToYuv444(frame.pixels.data(), numPixels, planes.data(), planes.data() + numPixels, planes.data() + 2 * numPixels);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (file == nullptr)
+        {
+            return;
+        }
+
+        if (nextFrame == 0 && pendingFrames.empty())
+        {
+            fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", frame.width, frame.height, framesPerSecond);
+        }
+
+        pendingFrames[frame.index] = std::move(planes);
+        for (auto it = pendingFrames.find(nextFrame); it != pendingFrames.end(); it = pendingFrames.find(nextFrame))
+        {
+            fputs("FRAME\n", file);
+            fwrite(it->second.data(), 1, it->second.size(), file);
+            pendingFrames.erase(it);
+            ++nextFrame;
+        }
+    }
+
+private:
+    FILE*                             file = nullptr;
+    bool                              ownsFile = false;
+    int                               framesPerSecond;
+    int                               nextFrame = 0;
+    std::map<int, std::vector<BYTE>>  pendingFrames;
+    std::mutex                        mutex;
+};
+
+FrameWriter Y4mFrameWriter(const std::shared_ptr<Y4mStreamWriter>& stream)
+{
+    return [stream](const Frame& frame) { stream->Write(frame); };
+}
+
+struct SequenceSettings
+{
+    int            width = 512;
+    int            height = 512;
+    int            numFrames = 60;
+    RenderSettings render = AnimationRenderSettings();
+    int            numWriterThreads = 2; // Writers run in parallel and may finish frames out of order
+    int            frameQueueCapacity = 4;
+};
+
+// Renders a camera path frame by frame on the renderer's worker pool. The tracing of consecutive frames does not
+// overlap: with temporal reuse every frame is seeded from the previous frame's finished film, so the pool drains at
+// each frame boundary. Everything else overlaps with tracing frame N: a helper thread moves the spheres to their frame
+// N + 1 positions in a second copy of the scene and refits its BVH, and frame N - 1 goes to writer threads through a
+// bounded queue only once frame N has started, so a full queue never holds up the workers. updateScene is optional
+// (the command line's orbit has a static scene and passes none); it must put the scene into its absolute state for
+// the given frame, since each scene copy is reused every other frame.
+void RenderSequence(Renderer& renderer, const Scene& baseScene, const SequenceSettings& settings,
+    const std::function<Camera(int frame)>& cameraPath, const std::function<void(int frame, Scene& scene)>& updateScene,
+    const FrameWriter& writer)
+{
+    auto prepareScene = [&updateScene](int frame, Scene& scene)
+    {
+        updateScene(frame, scene);
+        if (scene.bvh.sphereIndices.size() == scene.spheres.size())
+        {
+            scene.bvh.Refit(scene.spheres);
+        }
+        else
+        {
+            scene.bvh.Build(scene.spheres);
+        }
+    };
+
+    std::array<Scene, 2> scenes{ baseScene, baseScene };
+    if (updateScene)
+    {
+        prepareScene(0, scenes[0]);
+    }
+
+    BoundedQueue<Frame> frameQueue(std::max(1, settings.frameQueueCapacity));
+    std::vector<std::thread> writers;
+    for (int i = 0; i < std::max(1, settings.numWriterThreads); ++i)
+    {
+        writers.emplace_back([&frameQueue, &writer]()
+        {
+            Frame frame;
+            while (frameQueue.Pop(frame))
+            {
+                writer(frame);
+            }
+        });
+    }
+
+    // Starts a frame's render and, on the helper thread, prepares the scene copy for the frame after it. A static scene
+    // is rendered from one copy throughout, which lets the renderer keep its irradiance cache.
+    std::thread prepareThread;
+    auto startFrame = [&](int frame)
+    {
+        renderer.Start(settings.width, settings.height, settings.render, cameraPath(frame), updateScene ? &scenes[frame & 1] : &scenes[0]);
+        if (updateScene && frame + 1 < settings.numFrames)
+        {
+            prepareThread = std::thread(prepareScene, frame + 1, std::ref(scenes[(frame + 1) & 1]));
+        }
+    };
+
+    if (settings.numFrames > 0)
+    {
+        startFrame(0);
+    }
+    for (int frame = 0; frame < settings.numFrames; ++frame)
+    {
+        renderer.WaitUntilIdle();
+        if (prepareThread.joinable())
+        {
+            prepareThread.join();
+        }
+
+        Frame output;
+        output.index = frame;
+        output.width = settings.width;
+        output.height = settings.height;
+        renderer.CopyDisplayPixels(output.pixels);
+        if (frame + 1 < settings.numFrames)
+        {
+            startFrame(frame + 1);
+        }
+        frameQueue.Push(std::move(output));
+    }
+
+    frameQueue.Close();
+    for (std::thread& writerThread : writers)
+    {
+        writerThread.join();
+    }
+}
+
+// Built-in checks run by "--selftest". Each prints its measurements on one line and returns false if a bound is missed.
+bool SelfTestCancelLatency()
+{
+    const double kMaxLatencySeconds = 0.1;
+
+    struct Case
+    {
+        const char* name;
+        Integrator  integrator;
+        bool        caching; // Path guiding and irradiance caching, which add end-of-pass work
+    };
+    const Case cases[] = {
+        { "path", Integrator::Path, false },
+        { "path+caches", Integrator::Path, true },
+        { "bdpt", Integrator::Bidirectional, false },
+        { "mlt", Integrator::Metropolis, false },
+        { "light", Integrator::LightTracing, false },
+        { "photon", Integrator::PhotonMap, false },
+        { "restir", Integrator::Restir, false },
+    };
+
+    Renderer renderer;
+    bool passed = true;
+    printf("cancel latency:");
+    for (const Case& c : cases)
+    {
+        RenderSettings settings;
+        settings.integrator = c.integrator;
+        settings.maxSamplesPerPixel = 4096;
+        settings.relativeErrorLimit = 0.0f;
+        settings.pathGuiding = c.caching;
+        settings.irradianceCache = c.caching;
+        renderer.Start(256, 256, settings);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        const bool busy = !renderer.IsIdle();
+        const double latency = renderer.Cancel();
+        printf(" %s %.2f ms%s", c.name, latency * 1000.0, busy ? "" : " (finished early)");
+        passed = passed && busy && latency <= kMaxLatencySeconds;
+    }
+    printf(" -> %s\n", passed ? "ok" : "FAILED");
+    return passed;
+}
+
+// Full 1024x1024 frames of PreviewRenderSettings on every hardware thread, timed from Start to idle, the fastest of
+// kNumFrames counting. The preview integrator targets kTargetFramesPerSecond on a desktop with kTargetThreads hardware
+// threads; with fewer threads the target shrinks in proportion, since the tiles split over threads with no shared work.
+bool SelfTestPreviewThroughput()
+{
+    const int kSize = 1024;
+    const int kNumFrames = 2;
+    const double kTargetFramesPerSecond = 4.0;
+    const int kTargetThreads = 16;
+
+    const RenderSettings settings = PreviewRenderSettings();
+    Renderer renderer;
+    double fastest = DBL_MAX;
+    for (int frame = 0; frame < kNumFrames; ++frame)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        renderer.Start(kSize, kSize, settings);
+        renderer.WaitUntilIdle();
+        fastest = std::min(fastest, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    const int numThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    const double target = kTargetFramesPerSecond * std::min(numThreads, kTargetThreads) / kTargetThreads;
+    const double framesPerSecond = 1.0 / fastest;
+    const bool passed = framesPerSecond >= target;
+    printf("preview throughput: %.2f frames per second at %dx%d, %d spp on %d threads, target %.2f -> %s\n",
+        framesPerSecond, kSize, kSize, settings.maxSamplesPerPixel, numThreads, target, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+// Two frames of AnimationRenderSettings with the camera orbiting kAngle between them, once with temporal reuse and once
+// without, each compared by mean squared error against a converged render of the second view. Reprojected history
+// must let the second frame take fewer new samples for the same or a lower error.
+bool SelfTestTemporalReuse()
+{
+    const int kSize = 64;
+    const float kAngle = 0.02f;
+    const int kReferenceSamples = 2048;
+
+    Renderer renderer;
+    RenderSettings referenceSettings;
+    referenceSettings.maxSamplesPerPixel = kReferenceSamples;
+    referenceSettings.samplesPerPass = 64;
+    referenceSettings.relativeErrorLimit = 0.0f;
+    renderer.Start(kSize, kSize, referenceSettings, OrbitCamera(kAngle));
+    renderer.WaitUntilIdle();
+    std::vector<Vector3> reference;
+    renderer.CopyRadiance(reference);
+
+    int64_t samples[2];
+    double error[2];
+    for (int reuse = 0; reuse < 2; ++reuse)
+    {
+        RenderSettings settings = AnimationRenderSettings();
+        settings.temporalReuse = reuse != 0;
+        renderer.Start(kSize, kSize, settings, OrbitCamera(0.0f));
+        renderer.WaitUntilIdle();
+        renderer.Start(kSize, kSize, settings, OrbitCamera(kAngle));
+        renderer.WaitUntilIdle();
+        samples[reuse] = renderer.SamplesTaken();
+
+        std::vector<Vector3> radiance;
+        renderer.CopyRadiance(radiance);
+        double squaredError = 0.0;
+        for (size_t i = 0; i < radiance.size(); ++i)
+        {
+            const Vector3 difference = radiance[i] - reference[i];
+            squaredError += difference.Dot(difference);
+        }
+        error[reuse] = squaredError / (3.0 * radiance.size());
+    }
+
+    const bool passed = samples[1] < samples[0] && error[1] <= error[0];
+    printf("temporal reuse: second frame takes %lld samples for MSE %.2e with reuse, %lld for %.2e without -> %s\n",
+        static_cast<long long>(samples[1]), error[1], static_cast<long long>(samples[0]), error[0], passed ? "ok" : "FAILED");
+    return passed;
+}
+
+// Rays leaving surfaces of the default scene in random hemisphere directions, counted when they hit the sphere they
+// start on, which a convex surface cannot do. The scene is moved by kDistance so that its rounding error exceeds
+// kEpsilon, and the surface points are hit from above, spread over the ground sphere; the old kEpsilon offset is
+// counted for comparison.
+bool SelfTestRayOffsets()
+{
+    const int kNumRays = 1 << 20;
+    const float kExtent = 50.0f;
+    const Vector3 kDistance{ 1000.0f, 0.0f, 1000.0f };
+
+    Scene scene;
+    InitScene(scene);
+    for (Sphere& sphere : scene.spheres)
+    {
+        sphere.center = sphere.center + kDistance;
+    }
+    scene.bvh.Build(scene.spheres);
+
+    Random random(1);
+    int numLeaving = 0;
+    int epsilonSelfHits = 0;
+    int offsetSelfHits = 0;
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        Hit hit;
+        const Vector3 above{ (random.NextFloat() * 2.0f - 1.0f) * kExtent, 2.0f, (random.NextFloat() * 2.0f - 1.0f) * kExtent };
+        if (!IntersectScene(Ray{ kDistance + above, Vector3{ 0.0f, -1.0f, 0.0f } }, scene, hit))
+        {
+            continue;
+        }
+
+        const Vector3 direction = RandomVector(hit.normal, random.NextFloat(), random.NextFloat());
+        Hit next;
+        if (IntersectScene(Ray{ hit.position + hit.normal * kEpsilon, direction }, scene, next) && next.sphereIndex == hit.sphereIndex)
+        {
+            ++epsilonSelfHits;
+        }
+        if (IntersectScene(Ray{ OffsetRayOrigin(hit.position, hit.positionError, hit.normal, direction), direction }, scene, next) &&
+            next.sphereIndex == hit.sphereIndex)
+        {
+            ++offsetSelfHits;
+        }
+        ++numLeaving;
+    }
+
+    const bool passed = offsetSelfHits == 0;
+    printf("self-intersections: %d of %d rays with kEpsilon offsets, %d with OffsetRayOrigin -> %s\n", epsilonSelfHits,
+        numLeaving, offsetSelfHits, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+// Average time of body(i) over count calls, for the benchmarks below
+template< typename Func >
+double NanosecondsPerCall(int count, Func body)
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i)
+    {
+        body(i);
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+}
+
+// Fastest of numTrials timings of body over count calls: what the code costs when nothing else competes for the core,
+// for benchmarks that compare two timings against each other
+template< typename Func >
+double FastestNanosecondsPerCall(int numTrials, int count, Func body)
+{
+    double fastest = DBL_MAX;
+    for (int trial = 0; trial < numTrials; ++trial)
+    {
+        fastest = std::min(fastest, NanosecondsPerCall(count, body));
+    }
+    return fastest;
+}
+
+// Delta and ratio tracking through a thin and a dense homogeneous box and the default scene's smoke puff at its own and
+// ten times its density, against exp(-optical depth) integrated numerically along the ray. Each ray crosses the box
+// along x. Also reports the cost of each estimate, which grows with the number of majorant collisions.
+bool SelfTestMedia()
+{
+    const int kNumRays = 1 << 18;
+    const int kNumSteps = 1 << 16;
+
+    struct Case
+    {
+        const char* name;
+        Medium      medium;
+        float       offset; // Of the ray from the box's center line, in y and z
+    };
+    const Case cases[] = {
+        { "fog", Medium::Homogeneous(Vector3{ -1.0f }, Vector3{ 1.0f }, 1.0f, Vector3{ 0.9f }), 0.0f },
+        { "dense fog", Medium::Homogeneous(Vector3{ -1.0f }, Vector3{ 1.0f }, 3.0f, Vector3{ 0.9f }), 0.0f },
+        { "smoke", GenerateSmokeMedium(Vector3{ 0.0f }, 0.5f, 32, 40.0f), 0.25f },
+        { "dense smoke", GenerateSmokeMedium(Vector3{ 0.0f }, 0.5f, 32, 400.0f), 0.35f },
+    };
+
+    bool passed = true;
+    for (const Case& c : cases)
+    {
+        const float length = c.medium.boundsMax.x - c.medium.boundsMin.x;
+        const Ray ray{ Vector3{ c.medium.boundsMin.x, c.offset, c.offset }, Vector3{ 1.0f, 0.0f, 0.0f } };
+        double opticalDepth = 0.0;
+        for (int i = 0; i < kNumSteps; ++i)
+        {
+            opticalDepth += c.medium.Density(ray.origin + ray.direction * ((static_cast<float>(i) + 0.5f) * length / kNumSteps));
+        }
+        const double expected = exp(-opticalDepth * c.medium.sigmaT * length / kNumSteps);
+
+        Random random(1);
+        int numEscaped = 0;
+        const double deltaTime = NanosecondsPerCall(kNumRays, [&](int)
+        {
+            float distance;
+            numEscaped += c.medium.SampleCollision(ray, length, random, distance) ? 0 : 1;
+        });
+        double transmittance = 0.0;
+        const double ratioTime = NanosecondsPerCall(kNumRays, [&](int) { transmittance += c.medium.Transmittance(ray, length, random); });
+
+        // Three standard deviations of the escape fraction, which is the noisier estimate
+        const double delta = static_cast<double>(numEscaped) / kNumRays;
+        const double ratio = transmittance / kNumRays;
+        const double tolerance = 3.0 * sqrt(expected * (1.0 - expected) / kNumRays) + 1e-4 * expected;
+        const bool ok = fabs(delta - expected) <= tolerance && fabs(ratio - expected) <= tolerance;
+        printf("media %s: transmittance %.5f, delta tracking %.5f (%.0f ns), ratio tracking %.5f (%.0f ns) -> %s\n", c.name,
+            expected, delta, deltaTime, ratio, ratioTime, ok ? "ok" : "FAILED");
+        passed = passed && ok;
+    }
+    return passed;
+}
+
+// A cloud of kNumParticles small spheres traced at random shutter times, once standing still and once with each
+// sphere moving kTravel radii in a random direction over the shutter interval. Both go through the same motion-aware
+// BVH, so the difference is what the swept node bounds cost; the moving cloud may take at most kMaxOverhead as long
+// per ray. Trials alternate between the two and the fastest of each counts.
+bool SelfTestMotionBlurTraversal()
+{
+    const int kNumParticles = 4096;
+    const float kRadius = 0.01f;
+    const float kTravel = 4.0f;
+    const int kNumRays = 4096;
+    const int kNumTrials = 32;
+    const double kMaxOverhead = 1.25;
+
+    Random random(1);
+    Scene still;
+    for (int i = 0; i < kNumParticles; ++i)
+    {
+        const Vector3 center{ random.NextFloat() * 2.0f - 1.0f, random.NextFloat() * 2.0f - 1.0f, random.NextFloat() * 2.0f - 1.0f };
+        still.spheres.push_back(Sphere{ center, kRadius, 0 });
+    }
+    Scene moving = still;
+    for (Sphere& sphere : moving.spheres)
+    {
+        const Vector3 direction{ random.NextFloat() - 0.5f, random.NextFloat() - 0.5f, random.NextFloat() - 0.5f };
+        sphere.motion = direction.Normalize() * (kTravel * kRadius);
+    }
+    still.bvh.Build(still.spheres);
+    moving.bvh.Build(moving.spheres);
+
+    std::vector<Ray> rays(kNumRays);
+    for (Ray& ray : rays)
+    {
+        const Vector3 origin{ 0.0f, 0.0f, -3.0f };
+        const Vector3 target{ random.NextFloat() * 2.0f - 1.0f, random.NextFloat() * 2.0f - 1.0f, random.NextFloat() * 2.0f - 1.0f };
+        ray = Ray{ origin, (target - origin).Normalize(), random.NextFloat() };
+    }
+
+    int numHits[2] = { 0, 0 };
+    double time[2] = { DBL_MAX, DBL_MAX };
+    const Scene* scenes[2] = { &still, &moving };
+    for (int trial = 0; trial < kNumTrials; ++trial)
+    {
+        for (int s = 0; s < 2; ++s)
+        {
+            numHits[s] = 0;
+            time[s] = std::min(time[s], NanosecondsPerCall(kNumRays, [&](int i)
+            {
+                Hit hit;
+                numHits[s] += IntersectScene(rays[i], *scenes[s], hit) ? 1 : 0;
+            }));
+        }
+    }
+
+    const double overhead = time[1] / time[0];
+    const bool passed = overhead <= kMaxOverhead;
+    printf("motion blur traversal: %.0f ns per ray through still spheres (%d hits), %.0f ns moving (%d hits), %.2fx, "
+        "limit %.2fx -> %s\n", time[0], numHits[0], time[1], numHits[1], overhead, kMaxOverhead, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+// Scatters one hit off a random sequence of diffuse materials, once through MaterialTable::Visit as the integrators do
+// and once the way the renderer did before it had material kinds: an array of plain albedo and emission structs and a
+// direct call of the diffuse scatter, with no tag to dispatch on. Both must give the same weights, and the table may
+// be at most kMaxSlowdown slower than the plain path. Each is timed kNumTrials times, alternating, and the fastest
+// trial counts, which keeps scheduling noise out of the comparison.
+bool SelfTestMaterialDispatch()
+{
+    const int kNumMaterials = 1024;
+    const int kNumScatters = 1 << 16;
+    const int kSequenceLength = 1 << 12;
+    const int kNumTrials = 64;
+    const double kMaxSlowdown = 1.1;
+
+    struct PlainMaterial
+    {
+        Vector3 albedo;
+        Vector3 emissive;
+    };
+
+    Random random(1);
+    std::vector<PlainMaterial> plainMaterials;
+    MaterialTable table;
+    for (int i = 0; i < kNumMaterials; ++i)
+    {
+        const Vector3 albedo{ random.NextFloat(), random.NextFloat(), random.NextFloat() };
+        plainMaterials.push_back(PlainMaterial{ albedo, Vector3{ 0.0f } });
+        table.Add(Material{ Vector3{ 0.0f }, DiffuseBsdf{ albedo } });
+    }
+    std::vector<int> sequence(kSequenceLength);
+    for (int& material : sequence)
+    {
+        material = static_cast<int>(random.NextUint() % kNumMaterials);
+    }
+
+    const Ray ray{ Vector3{ 0.0f, 1.0f, -1.0f }, Vector3{ 0.0f, -1.0f, 1.0f }.Normalize() };
+    Hit hit;
+    hit.position = Vector3{ 0.0f };
+    hit.positionError = Vector3{ 1e-6f };
+    hit.normal = Vector3{ 0.0f, 1.0f, 0.0f };
+    hit.distance = ray.origin.Length();
+    hit.sphereIndex = 0;
+
+    double tableTime = DBL_MAX;
+    double plainTime = DBL_MAX;
+    bool sameWeights = true;
+    for (int trial = 0; trial < kNumTrials; ++trial)
+    {
+        Vector3 tableSum{ 0.0f };
+        Random tableRandom(2);
+        tableTime = std::min(tableTime, NanosecondsPerCall(kNumScatters, [&](int i)
+        {
+            Ray outRay;
+            tableSum = tableSum + table.Visit(sequence[i % kSequenceLength],
+                [&](const auto& bsdf) { return Scatter(bsdf, bsdf.albedo, ray, hit, tableRandom, outRay); });
+        }));
+
+        Vector3 plainSum{ 0.0f };
+        Random plainRandom(2);
+        plainTime = std::min(plainTime, NanosecondsPerCall(kNumScatters, [&](int i)
+        {
+            Ray outRay;
+            plainSum = plainSum + Scatter(DiffuseBsdf{}, plainMaterials[sequence[i % kSequenceLength]].albedo, ray, hit, plainRandom, outRay);
+        }));
+
+        sameWeights = sameWeights && tableSum.x == plainSum.x && tableSum.y == plainSum.y && tableSum.z == plainSum.z;
+    }
+
+    const bool passed = sameWeights && tableTime <= plainTime * kMaxSlowdown;
+    printf("material dispatch: %.1f ns per scatter through MaterialTable, %.1f ns with plain diffuse materials, limit "
+        "%.0f%% slower%s -> %s\n", tableTime, plainTime, (kMaxSlowdown - 1.0) * 100.0, sameWeights ? "" : ", weights differ",
+        passed ? "ok" : "FAILED");
+    return passed;
+}
+
+// Scatters kNumSamples rays off white glass at a spread of incidence angles, entering from outside and leaving from
+// inside. Fresnel transmittance from the transmitted amplitudes, computed here independently of FresnelDielectric, must
+// add up with its reflectance to 1; the share of reflected samples must match that reflectance within five standard
+// deviations; refracted directions must obey Snell's law; every weight must be 1, so no energy is lost or gained; and
+// past the critical angle on the way out every sample must be reflected.
+bool SelfTestDielectric()
+{
+    const int kNumSamples = 1 << 16;
+    const float kIor = 1.5f;
+    const float kAnglesDegrees[] = { 0.0f, 20.0f, 40.0f, 45.0f, 60.0f, 80.0f, 89.0f };
+
+    const DielectricBsdf bsdf{ Vector3{ 1.0f }, kIor };
+    Hit hit;
+    hit.position = Vector3{ 0.0f };
+    hit.positionError = Vector3{ 1e-6f };
+    hit.normal = Vector3{ 0.0f, 1.0f, 0.0f };
+    hit.distance = 1.0f;
+    hit.sphereIndex = 0;
+
+    Random random(1);
+    double maxEnergyError = 0.0;
+    double maxSnellError = 0.0;
+    double maxDeviation = 0.0;
+    double maxWeightError = 0.0;
+    int numTotalInternal = 0;
+    int numReflectedTotalInternal = 0;
+    for (int entering = 0; entering < 2; ++entering)
+    {
+        const double n1 = entering ? 1.0 : kIor;
+        const double n2 = entering ? kIor : 1.0;
+        for (float angle : kAnglesDegrees)
+        {
+            const float sinI = sinf(angle * (kPi / 180.0f));
+            const float cosI = cosf(angle * (kPi / 180.0f));
+            const Ray ray{ Vector3{ 0.0f }, Vector3{ sinI, entering ? -cosI : cosI, 0.0f } };
+            const double sinT = n1 / n2 * sinI;
+            const bool totalInternal = sinT >= 1.0;
+
+            double reflectance = 1.0;
+            if (!totalInternal)
+            {
+                float cosT;
+                reflectance = FresnelDielectric(cosI, static_cast<float>(n1 / n2), cosT);
+                const double cosTd = sqrt(1.0 - sinT * sinT);
+                const double perpendicular = 2.0 * n1 * cosI / (n1 * cosI + n2 * cosTd);
+                const double parallel = 2.0 * n1 * cosI / (n2 * cosI + n1 * cosTd);
+                const double transmittance = n2 * cosTd / (n1 * cosI) * 0.5 * (perpendicular * perpendicular + parallel * parallel);
+                maxEnergyError = std::max(maxEnergyError, fabs(reflectance + transmittance - 1.0));
+            }
+
+            int numReflected = 0;
+            for (int i = 0; i < kNumSamples; ++i)
+            {
+                Ray outRay;
+                const Vector3 weight = Scatter(bsdf, bsdf.albedo, ray, hit, random, outRay);
+                maxWeightError = std::max(maxWeightError, static_cast<double>(fabsf(weight.x - 1.0f) + fabsf(weight.y - 1.0f) + fabsf(weight.z - 1.0f)));
+                if ((outRay.direction.y > 0.0f) == entering)
+                {
+                    ++numReflected;
+                }
+                else
+                {
+                    maxSnellError = std::max(maxSnellError, fabs(n2 * outRay.direction.x - n1 * sinI));
+                }
+            }
+
+            if (totalInternal)
+            {
+                numTotalInternal += kNumSamples;
+                numReflectedTotalInternal += numReflected;
+            }
+            else
+            {
+                const double sigma = sqrt(std::max(reflectance * (1.0 - reflectance), 1e-12) / kNumSamples);
+                maxDeviation = std::max(maxDeviation, fabs(static_cast<double>(numReflected) / kNumSamples - reflectance) / sigma);
+            }
+        }
+    }
+
+    const bool passed = maxEnergyError <= 1e-5 && maxDeviation <= 5.0 && maxSnellError <= 1e-5 && maxWeightError == 0.0 &&
+        numTotalInternal > 0 && numReflectedTotalInternal == numTotalInternal;
+    printf("dielectric: reflectance plus transmittance off by %.1e, reflected share within %.1f sigma, snell error %.1e, "
+        "weights off by %.1e, %d of %d reflected past the critical angle -> %s\n", maxEnergyError, maxDeviation, maxSnellError,
+        maxWeightError, numReflectedTotalInternal, numTotalInternal, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+// White furnace for mirrors: a white conductor sphere inside a black shell that emits kEmission everywhere. A white
+// mirror reflects all light at every angle, so each pixel of a kSize render from inside the shell must come out as
+// kEmission whether it sees the mirror or the shell. A tinted mirror follows Schlick from its albedo at normal
+// incidence up to full reflection at grazing, so its pixels must stay between albedo and 1 times kEmission.
+bool SelfTestConductorFurnace()
+{
+    const int kSize = 64;
+    const float kEmission = 1.0f;
+    const float kTint = 0.25f;
+
+    Scene scene;
+    const int shell = scene.materials.Add(Material{ Vector3{ kEmission }, DiffuseBsdf{ Vector3{ 0.0f } } });
+    const int white = scene.materials.Add(Material{ Vector3{ 0.0f }, ConductorBsdf{ Vector3{ 1.0f } } });
+    const int tinted = scene.materials.Add(Material{ Vector3{ 0.0f }, ConductorBsdf{ Vector3{ kTint } } });
+    scene.spheres.push_back(Sphere{ Vector3{ 0.0f }, 10.0f, shell });
+    scene.spheres.push_back(Sphere{ Vector3{ 0.0f }, 1.0f, white });
+    scene.bvh.Build(scene.spheres);
 
-    Vector3 operator*(float rhs) const
+    Camera camera(Vector3{ 0.0f, 0.5f, -3.0f }, Vector3{ 0.0f });
+    camera.Prepare(kSize, kSize);
+    Random random(1);
+    double maxWhiteError = 0.0;
+    double maxTintedError = 0.0;
+    int numMirrorPixels = 0;
+    for (int material : { white, tinted })
     {
-        return { x * rhs, y * rhs, z * rhs };
+        scene.spheres[1].material = material;
+        for (int j = 0; j < kSize; ++j)
+        {
+            for (int i = 0; i < kSize; ++i)
+            {
+                const Ray ray = camera.GenerateRay(static_cast<float>(i), static_cast<float>(j));
+                const Vector3 radiance = TracePath(ray, scene, random);
+                Hit hit;
+                const bool seesMirror = IntersectScene(ray, scene, hit) && hit.sphereIndex == 1;
+                const float lowest = seesMirror && material == tinted ? kTint * kEmission : kEmission;
+                const float values[3] = { radiance.x, radiance.y, radiance.z };
+                for (float value : values)
+                {
+                    double& maxError = material == white ? maxWhiteError : maxTintedError;
+                    maxError = std::max(maxError, static_cast<double>(std::max(lowest - value, value - kEmission)));
+                }
+                numMirrorPixels += seesMirror && material == white ? 1 : 0;
+            }
+        }
     }
 
-    Vector3 operator+(float rhs) const
-    {
-        return { x + rhs, y + rhs, z + rhs };
-    }
+    const bool passed = maxWhiteError <= 1e-5 && maxTintedError <= 1e-5 && numMirrorPixels > 0;
+    printf("conductor furnace: %d mirror pixels, white mirror off by %.1e, tinted mirror outside its bounds by %.1e -> %s\n",
+        numMirrorPixels, maxWhiteError, maxTintedError, passed ? "ok" : "FAILED");
+    return passed;
+}
 
-    Vector3 Normalize() const
-    {
-        return *this * (1.0f / Length());
-    }
+// Renders the default view of the default scene until settings are met and returns its radiance
+std::vector<Vector3> RenderRadiance(Renderer& renderer, int size, const RenderSettings& settings)
+{
+    renderer.Start(size, size, settings);
+    renderer.WaitUntilIdle();
+    std::vector<Vector3> radiance;
+    renderer.CopyRadiance(radiance);
+    return radiance;
+}
 
-    float Distance(const Vector3& rhs) const
+double MeanRadiance(const std::vector<Vector3>& radiance)
+{
+    double sum = 0.0;
+    for (const Vector3& value : radiance)
     {
-        return (*this - rhs).Length();
+        sum += value.x + value.y + value.z;
     }
+    return sum / (3.0 * radiance.size());
+}
 
-    bool IsEquivalent(const Vector3& rhs, const float maxDelta = kEpsilon) const
+double MeanSquaredError(const std::vector<Vector3>& radiance, const std::vector<Vector3>& reference)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < radiance.size(); ++i)
     {
-        Vector3 delta = rhs - *this;
-        return delta.Length() < maxDelta;
+        const Vector3 difference = radiance[i] - reference[i];
+        sum += difference.Dot(difference);
     }
+    return sum / (3.0 * radiance.size());
+}
 
-    float x;
-    float y;
-    float z;
-};
+// The integrator tests share one image size and one converged TracePath render to compare against
+const int kIntegratorTestSize = 32;
 
-class Ray
+const std::vector<Vector3>& PathReference(Renderer& renderer)
 {
-public:
-    Vector3 origin;
-    Vector3 direction;
-};
+    const int kReferenceSamples = 4096;
 
-class Material
-{
-public:
-    Vector3 albedo;
-    Vector3 emissive;
-    float   roughness;
-};
+    static std::vector<Vector3> reference;
+    if (reference.empty())
+    {
+        RenderSettings settings;
+        settings.maxSamplesPerPixel = kReferenceSamples;
+        settings.minSamplesPerPixel = kReferenceSamples;
+        settings.samplesPerPass = 256;
+        reference = RenderRadiance(renderer, kIntegratorTestSize, settings);
+    }
+    return reference;
+}
 
-class Sphere
+// Renders kNumSamples per pixel with and without path guiding, in passes of kSamplesPerPass so that the default number
+// of training passes covers most of the render. Guiding must keep the image mean within kMaxMeanError of the reference and bring its
+// mean squared error down to at most kMaxErrorRatio of the unguided one.
+bool SelfTestPathGuiding()
 {
-public:
-    Vector3         center;
-    float           radius;
-    const Material* material;
-};
+    const int kNumSamples = 512;
+    const int kSamplesPerPass = 32;
+    const double kMaxMeanError = 0.01;
+    const double kMaxErrorRatio = 0.8;
 
-template< typename T >
-T Lerp(T val0, T val1, float t)
-{
-    return val0 + (val1 - val0) * t;
-}
+    Renderer renderer;
+    const std::vector<Vector3>& reference = PathReference(renderer);
+    RenderSettings settings;
+    settings.maxSamplesPerPixel = kNumSamples;
+    settings.minSamplesPerPixel = kNumSamples;
+    settings.samplesPerPass = kSamplesPerPass;
+    const std::vector<Vector3> unguided = RenderRadiance(renderer, kIntegratorTestSize, settings);
+    settings.pathGuiding = true;
+    const std::vector<Vector3> guided = RenderRadiance(renderer, kIntegratorTestSize, settings);
 
-float Saturate(float in)
-{
-    return in < 0.0f ? 0.0f : in > 1.0f ? 1.0f : in;
+    const double referenceMean = MeanRadiance(reference);
+    const double guidedMean = MeanRadiance(guided);
+    const double unguidedError = MeanSquaredError(unguided, reference);
+    const double guidedError = MeanSquaredError(guided, reference);
+    const bool ok = fabs(guidedMean - referenceMean) <= kMaxMeanError * referenceMean &&
+        guidedError <= kMaxErrorRatio * unguidedError;
+    printf("path guiding: mean %.4f (reference %.4f), mse %.2e (unguided %.2e) -> %s\n", guidedMean, referenceMean,
+        guidedError, unguidedError, ok ? "ok" : "FAILED");
+    return ok;
 }
 
-float Max(float a, float b)
+// Renders kNumSamples per pixel with the bidirectional integrator and with TracePath. Both converge to the same image,
+// so the bidirectional mean must lie within kMaxMeanError of the reference; its extra connections must bring the mean
+// squared error down to at most kMaxErrorRatio of the path tracer's.
+bool SelfTestBidirectional()
 {
-    return a > b ? a : b;
+    const int kNumSamples = 64;
+    const double kMaxMeanError = 0.01;
+    const double kMaxErrorRatio = 0.75;
+
+    Renderer renderer;
+    const std::vector<Vector3>& reference = PathReference(renderer);
+    RenderSettings settings;
+    settings.maxSamplesPerPixel = kNumSamples;
+    settings.minSamplesPerPixel = kNumSamples;
+    const std::vector<Vector3> path = RenderRadiance(renderer, kIntegratorTestSize, settings);
+    settings.integrator = Integrator::Bidirectional;
+    const std::vector<Vector3> bidirectional = RenderRadiance(renderer, kIntegratorTestSize, settings);
+
+    const double referenceMean = MeanRadiance(reference);
+    const double bidirectionalMean = MeanRadiance(bidirectional);
+    const double pathError = MeanSquaredError(path, reference);
+    const double bidirectionalError = MeanSquaredError(bidirectional, reference);
+    const bool ok = fabs(bidirectionalMean - referenceMean) <= kMaxMeanError * referenceMean &&
+        bidirectionalError <= kMaxErrorRatio * pathError;
+    printf("bidirectional: mean %.4f (reference %.4f), mse %.2e (path %.2e) -> %s\n", bidirectionalMean, referenceMean,
+        bidirectionalError, pathError, ok ? "ok" : "FAILED");
+    return ok;
 }
 
-// Returns number of intersections
-int Intersect(const Ray& ray, const Sphere& sphere, std::array<Vector3, 2>& result)
+// The splatting integrators spread each pixel's samples over the whole pixel, where the renderer's TracePath samples
+// its center. Their reference traces TracePath from uniformly jittered positions instead, at the test resolution, since
+// ray cones, and with them texture filtering, depend on the pixel size.
+const std::vector<Vector3>& BoxFilteredPathReference(Renderer& renderer)
 {
-    // Calculate discriminant
-    Vector3 rayOriginToSphereCenter = ray.origin - sphere.center;
-    float a = ray.direction.Dot(ray.direction);
-    float b = 2.0f * ray.direction.Dot(rayOriginToSphereCenter);
-    float c = rayOriginToSphereCenter.Dot(rayOriginToSphereCenter) - sphere.radius * sphere.radius;
-    float discriminant = b * b - 4.0f * a * c;
+    const int kReferenceSamples = 1024;
 
-    if (discriminant < 0.0f)
-    {
-        return 0;
-    }
-    else
+    static std::vector<Vector3> reference;
+    if (reference.empty())
     {
-        int numIntersections = 0;
-
-        // Solve quadratic for real roots
-        float t0 = (-1.0f * b + sqrtf(discriminant)) / (2.0f * a);
-        if (t0 >= 0.0f)
+        Camera camera = DefaultCamera();
+        camera.Prepare(kIntegratorTestSize, kIntegratorTestSize);
+        Random random(1);
+        reference.resize(kIntegratorTestSize * kIntegratorTestSize);
+        for (int j = 0; j < kIntegratorTestSize; ++j)
         {
-            result[numIntersections++] = ray.origin + ray.direction * t0;
-        }
-
-        if (discriminant > kEpsilon)
-        {
-            float t1 = (-1.0f * b - sqrtf(discriminant)) / (2.0f * a);
-            if (t1 >= 0.0f)
+            for (int i = 0; i < kIntegratorTestSize; ++i)
             {
-                result[numIntersections++] = ray.origin + ray.direction * t1;
-
-                // Order by distance; smallest positive root is closest
-                if ((t0 >= 0.0f && t1 >= 0.0f) && (t1 < t0))
+                Vector3 sum{ 0.0f };
+                for (int s = 0; s < kReferenceSamples; ++s)
                 {
-                    std::swap(result[0], result[1]);
+                    const float x = static_cast<float>(i) + random.NextFloat() - 0.5f;
+                    const float y = static_cast<float>(j) + random.NextFloat() - 0.5f;
+                    sum = sum + TracePath(camera.GenerateRay(x, y), renderer.DefaultScene(), random);
                 }
+                reference[j * kIntegratorTestSize + i] = sum * (1.0f / kReferenceSamples);
             }
         }
-
-        return numIntersections;
     }
+    return reference;
 }
 
-void RandomTangentFrame(const Vector3& normal, Vector3& outTangent, Vector3& outBitangent)
+// Renders kNumSamples mutations per pixel with Metropolis light transport. The image brightness comes from a bootstrap
+// estimate over 65536 paths, whose standard deviation is about 1.2% of the mean here, so the mean may stray up to three
+// of those, kMaxMeanError, from the box-filtered reference.
+bool SelfTestMetropolis()
 {
-    const Vector3 right{ -1.0f, 0.0f, 0.0f };
-    const Vector3 up{ 0.0f, 1.0f, 0.0f };
+    const int kNumSamples = 1024;
+    const double kMaxMeanError = 0.036;
 
-    outTangent = normal.IsEquivalent(right) ? up : right;
-    outBitangent = normal.Cross(outTangent).Normalize();
-    outTangent = outBitangent.Cross(normal).Normalize();
+    Renderer renderer;
+    const double referenceMean = MeanRadiance(BoxFilteredPathReference(renderer));
+    RenderSettings settings;
+    settings.maxSamplesPerPixel = kNumSamples;
+    settings.samplesPerPass = 64;
+    settings.integrator = Integrator::Metropolis;
+    const double mean = MeanRadiance(RenderRadiance(renderer, kIntegratorTestSize, settings));
+    const bool ok = fabs(mean - referenceMean) <= kMaxMeanError * referenceMean;
+    printf("metropolis: mean %.4f (reference %.4f) -> %s\n", mean, referenceMean, ok ? "ok" : "FAILED");
+    return ok;
 }
 
-Vector3 RandomVector(const Vector3& normal, float rand0, float rand1)
+// Renders the default scene from the lights: light tracing splats kNumLightSamples per pixel over whole pixels and is
+// held to the box-filtered reference, while the photon map shades pixel centers from kNumPhotonPaths photons and is held
+// to the TracePath reference. Either mean may differ by kMaxMeanError, several times the spread over repeated renders,
+// since the photon map's density estimate also blurs light across its lookup radius.
+bool SelfTestLightTracing()
 {
-    // Random direction over hemisphere centered on (0, 1, 0)
-    // (x, y, z) = (sqrt(1 - rand0^2)*cos(2*pi*rand1), rand0, sqrt(1 - rand0^2)*sin(2*pi*rand1))
-    float sqrtFactor = sqrtf(1.0f - rand0 * rand0);
-    float cosFactor = cosf(2.0f * kPi * rand1);
-    float sinFactor = sinf(2.0f * kPi * rand1);
-    Vector3 randVec = Vector3{ sqrtFactor * cosFactor, rand0, sqrtFactor * sinFactor };
+    const int kNumLightSamples = 256;
+    const int kNumPhotonSamples = 16;
+    const int kNumPhotonPaths = 1 << 16;
+    const double kMaxMeanError = 0.02;
 
-    // Transform to 'arbitrary' tangent frame centered around normal
-    Vector3 tangent;
-    Vector3 bitangent;
-    RandomTangentFrame(normal, tangent, bitangent);
-    Vector3 rowX{ tangent.x, normal.x, bitangent.x };
-    Vector3 rowY{ tangent.y, normal.y, bitangent.y };
-    Vector3 rowZ{ tangent.z, normal.z, bitangent.z };
+    Renderer renderer;
+    const double boxReferenceMean = MeanRadiance(BoxFilteredPathReference(renderer));
+    const double pathReferenceMean = MeanRadiance(PathReference(renderer));
+    RenderSettings settings;
+    settings.maxSamplesPerPixel = kNumLightSamples;
+    settings.samplesPerPass = 64;
+    settings.integrator = Integrator::LightTracing;
+    const double lightMean = MeanRadiance(RenderRadiance(renderer, kIntegratorTestSize, settings));
 
-    Vector3 result{ randVec.Dot(rowX), randVec.Dot(rowY), randVec.Dot(rowZ) };
-    return result;
+    settings = RenderSettings();
+    settings.maxSamplesPerPixel = kNumPhotonSamples;
+    settings.minSamplesPerPixel = kNumPhotonSamples;
+    settings.photonPaths = kNumPhotonPaths;
+    settings.integrator = Integrator::PhotonMap;
+    const double photonMean = MeanRadiance(RenderRadiance(renderer, kIntegratorTestSize, settings));
+
+    const bool ok = fabs(lightMean - boxReferenceMean) <= kMaxMeanError * boxReferenceMean &&
+        fabs(photonMean - pathReferenceMean) <= kMaxMeanError * pathReferenceMean;
+    printf("light tracing: mean %.4f (reference %.4f), photon map mean %.4f (reference %.4f) -> %s\n", lightMean,
+        boxReferenceMean, photonMean, pathReferenceMean, ok ? "ok" : "FAILED");
+    return ok;
 }
 
-Vector3 TracePath(const Ray& ray, const std::vector<Sphere>& spheres, int bounce)
+// Renders kNumSamples per pixel with and without the irradiance cache, kNumTrials times each, alternating, with the
+// fastest trial of each counting. The cache carries over between the renderer's renders of the same scene, so later
+// trials start from a warm cache. Few paths in the open default scene bounce often enough to repay what recording
+// costs, so the cache is only held to its bias and overhead: the mean within kMaxMeanError of the reference, the time
+// at most kMaxSlowdown and the mean squared error at most kMaxErrorRatio of the path tracer's.
+bool SelfTestIrradianceCache()
 {
-    const int kMaxBounces = 6;
-    if (bounce == kMaxBounces)
+    const int kNumSamples = 256;
+    const int kNumTrials = 5;
+    const double kMaxMeanError = 0.01;
+    const double kMaxSlowdown = 1.5;
+    const double kMaxErrorRatio = 1.25;
+
+    Renderer renderer;
+    const std::vector<Vector3>& reference = PathReference(renderer);
+    RenderSettings settings;
+    settings.maxSamplesPerPixel = kNumSamples;
+    settings.minSamplesPerPixel = kNumSamples;
+    settings.samplesPerPass = 32;
+    double pathTime = DBL_MAX;
+    double cacheTime = DBL_MAX;
+    std::vector<Vector3> path;
+    std::vector<Vector3> cached;
+    for (int trial = 0; trial < kNumTrials; ++trial)
     {
-        return Vector3{ 0.0f, 0.0f, 0.0f };
+        for (int useCache = 0; useCache < 2; ++useCache)
+        {
+            settings.irradianceCache = useCache != 0;
+            const auto start = std::chrono::steady_clock::now();
+            std::vector<Vector3> radiance = RenderRadiance(renderer, kIntegratorTestSize, settings);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            (useCache ? cacheTime : pathTime) = std::min(useCache ? cacheTime : pathTime, seconds);
+            (useCache ? cached : path) = std::move(radiance);
+        }
     }
 
-    int nearestSphereIndex = INT_MAX;
-    float nearestDistance = FLT_MAX;
-    Vector3 nearestIntersection(FLT_MAX);
+    const double referenceMean = MeanRadiance(reference);
+    const double cachedMean = MeanRadiance(cached);
+    const double pathError = MeanSquaredError(path, reference);
+    const double cachedError = MeanSquaredError(cached, reference);
+    const bool ok = fabs(cachedMean - referenceMean) <= kMaxMeanError * referenceMean &&
+        cacheTime <= kMaxSlowdown * pathTime && cachedError <= kMaxErrorRatio * pathError;
+    printf("irradiance cache: mean %.4f (reference %.4f), %.3f s for mse %.2e (path %.3f s for %.2e) -> %s\n", cachedMean,
+        referenceMean, cacheTime, cachedError, pathTime, pathError, ok ? "ok" : "FAILED");
+    return ok;
+}
 
-    for (int i = 0; i < spheres.size(); ++i)
+// Direct light through a jittered position in pixel (i, j) from one uniform point on a uniformly chosen emitter, which
+// is what Integrator::Restir estimates with a single candidate and no reuse. Pixels that do not see a diffuse surface
+// first are shaded by the preview integrator, as there.
+Vector3 UniformLightSample(const Scene& scene, const Camera& camera, int i, int j, Random& random)
+{
+    const float x = static_cast<float>(i) + random.NextFloat() - 0.5f;
+    const float y = static_cast<float>(j) + random.NextFloat() - 0.5f;
+    const Ray ray = camera.GenerateRay(x, y);
+    Hit hit;
+    if (!IntersectScene(ray, scene, hit) || scene.materials.types[scene.spheres[hit.sphereIndex].material] != MaterialType::Diffuse)
     {
-        std::array<Vector3, 2> intersection{};
-        int numIntersections = Intersect(ray, spheres[i], intersection);
-        if (numIntersections > 0)
+        return TraceDirect(ray, scene, random);
+    }
+
+    const ShadingPoint surface{ hit.position, hit.normal, SurfaceAlbedo(scene, ray, hit), hit.sphereIndex, 0.0f, hit.positionError };
+    const Vector3 emission = scene.materials.emissive[scene.spheres[hit.sphereIndex].material];
+    const int numLights = static_cast<int>(scene.lights.size());
+    const int light = scene.lights[std::min(static_cast<int>(random.NextFloat() * static_cast<float>(numLights)), numLights - 1)];
+    float normalRand0 = random.NextFloat();
+    float normalRand1 = random.NextFloat();
+    Vector3 lightNormal;
+    RandomSphereVectors(&normalRand0, &normalRand1, 1, &lightNormal);
+    Vector3 direction;
+    float distance;
+    const Vector3 unshadowed = UnshadowedLight(scene, surface, light, lightNormal, direction, distance);
+    if (Luminance(unshadowed) <= 0.0f ||
+        IsOccluded(Ray{ OffsetRayOrigin(surface.position, surface.positionError, surface.normal, direction), direction, 0.0f }, scene, distance * 0.999f))
+    {
+        return emission;
+    }
+    const float radius = scene.spheres[light].radius;
+    return emission + unshadowed * (static_cast<float>(numLights) * 4.0f * kPi * radius * radius);
+}
+
+// Renders one sample per pixel with reservoir resampling and with UniformLightSample, both compared against
+// kReferenceSamples of UniformLightSample. Resampling 16 candidates and the neighbors' reservoirs must bring the mean
+// squared error down to at most kMaxErrorRatio of a single uniform sample's. Trusting neighbors biases the image a
+// little, so after kNumSamples the mean must lie within kMaxMeanError of the reference.
+bool SelfTestRestir()
+{
+    const int kReferenceSamples = 1024;
+    const int kNumSamples = 64;
+    const double kMaxErrorRatio = 0.6;
+    const double kMaxMeanError = 0.02;
+
+    Renderer renderer;
+    const Scene& scene = renderer.DefaultScene();
+    Camera camera = DefaultCamera();
+    camera.Prepare(kIntegratorTestSize, kIntegratorTestSize);
+    Random random(1);
+    std::vector<Vector3> reference(kIntegratorTestSize * kIntegratorTestSize);
+    std::vector<Vector3> uniform(kIntegratorTestSize * kIntegratorTestSize);
+    for (int j = 0; j < kIntegratorTestSize; ++j)
+    {
+        for (int i = 0; i < kIntegratorTestSize; ++i)
         {
-            float distance = (intersection[0] - ray.origin).Length();
-            if (distance < nearestDistance)
+            Vector3 sum{ 0.0f };
+            for (int s = 0; s < kReferenceSamples; ++s)
             {
-                nearestSphereIndex = i;
-                nearestIntersection = intersection[0];
-                nearestDistance = distance;
+                sum = sum + UniformLightSample(scene, camera, i, j, random);
             }
+            reference[j * kIntegratorTestSize + i] = sum * (1.0f / kReferenceSamples);
+            uniform[j * kIntegratorTestSize + i] = UniformLightSample(scene, camera, i, j, random);
         }
     }
 
-    if (nearestSphereIndex == INT_MAX)
+    RenderSettings settings;
+    settings.maxSamplesPerPixel = 1;
+    settings.samplesPerPass = 1;
+    settings.integrator = Integrator::Restir;
+    const std::vector<Vector3> resampled = RenderRadiance(renderer, kIntegratorTestSize, settings);
+    settings.maxSamplesPerPixel = kNumSamples;
+    settings.minSamplesPerPixel = kNumSamples;
+    const double referenceMean = MeanRadiance(reference);
+    const double mean = MeanRadiance(RenderRadiance(renderer, kIntegratorTestSize, settings));
+
+    const double uniformError = MeanSquaredError(uniform, reference);
+    const double resampledError = MeanSquaredError(resampled, reference);
+    const bool ok = resampledError <= kMaxErrorRatio * uniformError && fabs(mean - referenceMean) <= kMaxMeanError * referenceMean;
+    printf("restir: 1 spp mse %.3f (uniform light sampling %.3f), %d spp mean %.4f (reference %.4f) -> %s\n", resampledError,
+        uniformError, kNumSamples, mean, referenceMean, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// Statistics of RandomLanes over kNumChunks fills: mean, variance, a 256-bucket chi-square, a 64x64 chi-square of
+// successive numbers of one lane, and correlations between successive numbers of a lane, between neighboring lanes and
+// between two seeds. Every statistic must lie within five standard deviations of its expected value. Every lane width
+// the build has, four and with AVX2 eight, must also give the same bits as scalar xoshiro128+ steps of each lane over
+// fills that end partway through a step. Also reports throughput against the scalar Random.
+bool SelfTestRandomLanes()
+{
+    const int kChunkSize = 4096;
+    const int kNumChunks = 4096;
+    const int kNumBuckets = 256;
+    const int kNumPairBuckets = 64;
+    const int kLanes = RandomLanes::kNumLanes;
+    const int kNumCheckedFills = 4;
+    const int kCheckedFillSize = 1021;
+
+    // Reference steps for one lane, on the same state words the vector code keeps
+    auto scalarNext = [](RandomLanes& generator, int lane)
     {
-        #if USE_SKY_COLOR == 1
-        return Lerp(Vector3{ 0.0f, 0.0f, 0.0f }, Vector3{ 0.25f, 0.55f, 0.75f }, ray.direction.y);
-        #else
-        return Vector3{ 0.0f, 0.0f, 0.0f };
-        #endif//USE_SKY_COLOR
+        uint32_t* const s = &generator.state[0][lane];
+        const uint32_t result = s[0] + s[3 * kLanes];
+        const uint32_t t = s[kLanes] << 9;
+        s[2 * kLanes] ^= s[0];
+        s[3 * kLanes] ^= s[kLanes];
+        s[kLanes] ^= s[2 * kLanes];
+        s[0] ^= s[3 * kLanes];
+        s[2 * kLanes] ^= t;
+        s[3 * kLanes] = (s[3 * kLanes] << 11) | (s[3 * kLanes] >> 21);
+        return static_cast<float>(result >> 8) * (1.0f / 16777216.0f);
+    };
+    auto countMismatches = [&](void (RandomLanes::*fill)(float*, int))
+    {
+        RandomLanes lanes(1);
+        RandomLanes scalar(1);
+        std::vector<float> filled(kCheckedFillSize);
+        int mismatches = 0;
+        for (int f = 0; f < kNumCheckedFills; ++f)
+        {
+            (lanes.*fill)(filled.data(), kCheckedFillSize);
+            for (int i = 0; i < (kCheckedFillSize + kLanes - 1) / kLanes * kLanes; ++i)
+            {
+                const float expected = scalarNext(scalar, i % kLanes);
+                mismatches += i < kCheckedFillSize && filled[i] != expected ? 1 : 0;
+            }
+        }
+        return mismatches;
+    };
+    #if defined(__AVX2__)
+    const int mismatches = countMismatches(&RandomLanes::Fillx4) + countMismatches(&RandomLanes::Fillx8);
+    const char* const widths = "four- and eight-wide";
+    #else
+    const int mismatches = countMismatches(&RandomLanes::Fillx4);
+    const char* const widths = "four-wide";
+    #endif//__AVX2__
+
+    RandomLanes random(1);
+    RandomLanes otherSeed(2);
+    std::vector<float> values(kChunkSize);
+    std::vector<float> otherValues(kChunkSize);
+    std::vector<double> buckets(kNumBuckets, 0.0);
+    std::vector<double> pairBuckets(kNumPairBuckets * kNumPairBuckets, 0.0);
+    double sum = 0.0;
+    double sumSq = 0.0;
+    double serialSum = 0.0;
+    double laneSum = 0.0;
+    double seedSum = 0.0;
+    double numSerial = 0.0;
+    double numLane = 0.0;
+    for (int chunk = 0; chunk < kNumChunks; ++chunk)
+    {
+        random.Fill(values.data(), kChunkSize);
+        otherSeed.Fill(otherValues.data(), kChunkSize);
+        for (int i = 0; i < kChunkSize; ++i)
+        {
+            const double value = values[i];
+            sum += value;
+            sumSq += value * value;
+            buckets[static_cast<int>(value * kNumBuckets)] += 1.0;
+            seedSum += value * otherValues[i];
+            if (i + kLanes < kChunkSize)
+            {
+                serialSum += value * values[i + kLanes];
+                numSerial += 1.0;
+                pairBuckets[static_cast<int>(value * kNumPairBuckets) * kNumPairBuckets + static_cast<int>(values[i + kLanes] * kNumPairBuckets)] += 1.0;
+            }
+            if (i % kLanes != kLanes - 1)
+            {
+                laneSum += value * values[i + 1];
+                numLane += 1.0;
+            }
+        }
     }
-    else
+
+    auto chiSquare = [](const std::vector<double>& counts)
     {
-        const Sphere& closestSphere = spheres[nearestSphereIndex];
-        Vector3 normal = (nearestIntersection - closestSphere.center).Normalize();
+        double total = 0.0;
+        for (double count : counts)
+        {
+            total += count;
+        }
+        const double expected = total / static_cast<double>(counts.size());
+        double result = 0.0;
+        for (double count : counts)
+        {
+            result += (count - expected) * (count - expected) / expected;
+        }
+        return result;
+    };
+    // Pearson correlation of uniform numbers from the mean of their products
+    auto correlation = [](double productSum, double count) { return (productSum / count - 0.25) * 12.0; };
 
-        float rand0 = (float)(rand()) / (float)(RAND_MAX + 1);
-        float rand1 = (float)(rand()) / (float)(RAND_MAX + 1);
-        Vector3 newDir = RandomVector(normal, rand0, rand1);
-        
-        float check = newDir.Dot(normal);
-        assert(check >= (0.0f - kEpsilon));
+    const double n = static_cast<double>(kChunkSize) * kNumChunks;
+    const double mean = sum / n;
+    const double variance = sumSq / n - mean * mean;
+    const double chi = chiSquare(buckets);
+    const double pairChi = chiSquare(pairBuckets);
+    const double serial = correlation(serialSum, numSerial);
+    const double lane = correlation(laneSum, numLane);
+    const double seed = correlation(seedSum, n);
+    const double dof = kNumBuckets - 1;
+    const double pairDof = kNumPairBuckets * kNumPairBuckets - 1;
+    const double maxCorrelation = 5.0 / sqrt(numSerial);
+    const bool passed = mismatches == 0 && fabs(mean - 0.5) <= 5.0 * sqrt(1.0 / (12.0 * n)) && fabs(variance - 1.0 / 12.0) <= 5.0 * sqrt((1.0 / 80.0 - 1.0 / 144.0) / n) &&
+        chi <= dof + 5.0 * sqrt(2.0 * dof) && pairChi <= pairDof + 5.0 * sqrt(2.0 * pairDof) &&
+        fabs(serial) <= maxCorrelation && fabs(lane) <= maxCorrelation && fabs(seed) <= maxCorrelation;
 
-        Ray newRay{ nearestIntersection + normal * kEpsilon, newDir };
-        return closestSphere.material->emissive + closestSphere.material->albedo * TracePath(newRay, spheres, ++bounce) * normal.Dot(newDir);
-    }
-}
+    // Summing the numbers keeps the generators from being optimized away
+    float lanesSum = 0.0f;
+    const int kNumFills = 1 << 12;
+    const double lanesTime = NanosecondsPerCall(kNumFills, [&](int)
+    {
+        random.Fill(values.data(), kChunkSize);
+        lanesSum += values[0];
+    }) / kChunkSize;
+    Random scalar(1);
+    float scalarSum = 0.0f;
+    const double scalarTime = NanosecondsPerCall(kNumFills * kChunkSize, [&](int) { scalarSum += scalar.NextFloat(); });
+    volatile float sink = lanesSum + scalarSum;
+    (void)sink;
 
-Sphere GenerateTangentSphere(const Sphere& sphere, const Vector3& center, const Material* material)
-{
-    return Sphere{ center, (center - sphere.center).Length() - sphere.radius, material };
+    printf("random lanes: %d scalar/%s mismatches, mean %.5f, variance %.5f, chi-square %.0f (%.0f dof), pair chi-square "
+        "%.0f (%.0f dof), correlations %.1e serial %.1e lanes %.1e seeds, %.2f Gfloat/s against %.2f scalar -> %s\n", mismatches,
+        widths, mean, variance, chi, dof, pairChi, pairDof, serial, lane, seed, 1.0 / lanesTime, 1.0 / scalarTime,
+        passed ? "ok" : "FAILED");
+    return passed;
 }
 
-Sphere GenerateOffsetSphere(const Sphere& sphere, const Vector3& center, float offset, const Material* material)
+// SinCos2Pi and SinCos2Pix4 over evenly spaced turns in [-1, 1]: error against double precision within the documented
+// 4e-7, and the same bits from both versions. Also times both against sinf plus cosf; the scalar version is what
+// RandomVector uses on every diffuse bounce, so it must not be slower than the library.
+bool SelfTestSinCos()
 {
-    return Sphere{ center, (center - sphere.center).Length() - sphere.radius - offset, material };
+    const int kNumTurns = 1 << 23;
+    const int kBatchSize = 4096;
+    const int kNumBatches = 4;
+    const int kNumTrials = 256;
+
+    double maxError = 0.0;
+    int mismatches = 0;
+    for (int i = 0; i < kNumTurns; i += 4)
+    {
+        alignas(16) float turns[4];
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            turns[lane] = -1.0f + 2.0f * (static_cast<float>(i + lane) + 0.5f) / static_cast<float>(kNumTurns);
+        }
+        __m128 sinValues;
+        __m128 cosValues;
+        SinCos2Pix4(_mm_load_ps(turns), sinValues, cosValues);
+        alignas(16) float sinLanes[4];
+        alignas(16) float cosLanes[4];
+        _mm_store_ps(sinLanes, sinValues);
+        _mm_store_ps(cosLanes, cosValues);
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            float sinValue;
+            float cosValue;
+            SinCos2Pi(turns[lane], sinValue, cosValue);
+            const double angle = 2.0 * 3.14159265358979323846 * static_cast<double>(turns[lane]);
+            maxError = std::max(maxError, std::max(fabs(sinValue - sin(angle)), fabs(cosValue - cos(angle))));
+            mismatches += sinValue != sinLanes[lane] || cosValue != cosLanes[lane] ? 1 : 0;
+        }
+    }
+
+    alignas(16) float turns[kBatchSize];
+    Random random(1);
+    for (float& turn : turns)
+    {
+        turn = random.NextFloat();
+    }
+
+    // The three are timed alternately so they share whatever else the machine is doing, and each keeps its fastest
+    // trial. Summing the results keeps the calls from being optimized away.
+    float sum = 0.0f;
+    __m128 sum4 = _mm_setzero_ps();
+    double scalarTime = DBL_MAX;
+    double batchTime = DBL_MAX;
+    double libraryTime = DBL_MAX;
+    for (int trial = 0; trial < kNumTrials; ++trial)
+    {
+        scalarTime = std::min(scalarTime, NanosecondsPerCall(kNumBatches, [&](int)
+        {
+            for (int i = 0; i < kBatchSize; ++i)
+            {
+                float sinValue;
+                float cosValue;
+                SinCos2Pi(turns[i], sinValue, cosValue);
+                sum += sinValue + cosValue;
+            }
+        }) / kBatchSize);
+        batchTime = std::min(batchTime, NanosecondsPerCall(kNumBatches, [&](int)
+        {
+            for (int i = 0; i < kBatchSize; i += 4)
+            {
+                __m128 sinValues;
+                __m128 cosValues;
+                SinCos2Pix4(_mm_load_ps(turns + i), sinValues, cosValues);
+                sum4 = _mm_add_ps(sum4, _mm_add_ps(sinValues, cosValues));
+            }
+        }) / kBatchSize);
+        libraryTime = std::min(libraryTime, NanosecondsPerCall(kNumBatches, [&](int)
+        {
+            for (int i = 0; i < kBatchSize; ++i)
+            {
+                sum += sinf(2.0f * kPi * turns[i]) + cosf(2.0f * kPi * turns[i]);
+            }
+        }) / kBatchSize);
+    }
+    volatile float sink = sum + _mm_cvtss_f32(sum4);
+    (void)sink;
+
+    const bool passed = maxError <= 4e-7 && mismatches == 0 && scalarTime <= libraryTime;
+    printf("sincos: max error %.1e, %d scalar/four-wide mismatches, %.1f ns scalar, %.1f ns four-wide, %.1f ns sinf plus cosf "
+        "-> %s\n", maxError, mismatches, scalarTime, batchTime, libraryTime, passed ? "ok" : "FAILED");
+    return passed;
 }
 
-void InitScene(std::vector<Sphere>& spheres, std::vector<Material>& materials)
+// ReciprocalSqrt and ReciprocalSqrtx4 over every kStride-th positive normal float: relative error within the documented
+// 4e-7, and the same bits from both versions. A small direct lighting image of the default scene is rendered with its
+// camera directions normalized both ways, scaled off unit length first so both have work to do, and the RMS difference
+// must stay under kMaxImageRms. Also times normalizing a batch of vectors one and four at a time with it against sqrt
+// and a division, the ways Normalize and Camera::GenerateRays can be built.
+bool SelfTestReciprocalSqrt()
 {
-    materials.emplace_back(Material{ Vector3{1.0f, 1.0f, 1.0f}, Vector3{0.0f, 0.0f, 0.0f}, {1.0f} });
-    materials.emplace_back(Material{ Vector3{0.5f, 1.0f, 0.5f}, Vector3{10.0f, 10.0f, 10.0f}, {1.0f} });
-    materials.emplace_back(Material{ Vector3{1.0f, 0.5f, 0.5f}, Vector3{0.0f, 0.0f, 0.0f}, {1.0f} });
-    materials.emplace_back(Material{ Vector3{0.5f, 0.5f, 1.0f}, Vector3{0.0f, 0.0f, 0.0f}, {1.0f} });
-    materials.emplace_back(Material{ Vector3{0.5f, 1.0f, 0.75f}, Vector3{0.0f, 0.0f, 0.0f}, {1.0f} });
-    materials.emplace_back(Material{ Vector3{1.0f, 1.0f, 0.5f}, Vector3{10.0f, 5.0f, 5.0f}, {1.0f} });
-    materials.emplace_back(Material{ Vector3{1.0f, 1.0f, 1.0f}, Vector3{0.0f, 0.0f, 0.0f}, {1.0f} });
-    materials.emplace_back(Material{ Vector3{0.5f, 1.0f, 1.0f}, Vector3{5.0f, 5.0f, 10.0f}, {1.0f} });
+    const uint32_t kStride = 127;
+    const int kBatchSize = 4096;
+    const int kNumBatches = 2048;
+    const int kImageSize = 64;
+    const double kMaxImageRms = 1e-3;
 
-    const float globalRadius = 100.0f;
-    Vector3 globalCenter{ 0.0f, -globalRadius, 0.0f };
-    spheres.emplace_back(Sphere{ globalCenter, {100.0f}, {&materials[0]} });
-    spheres.emplace_back(GenerateOffsetSphere(spheres[0], Vector3{ 0.0f, 0.25f, 0.0f }, 0.125f, &materials[1]));
-    spheres.emplace_back(GenerateTangentSphere(spheres[0], Vector3{-0.5f, 0.125f, 0.0f}, &materials[2]));
-    spheres.emplace_back(GenerateTangentSphere(spheres[0], Vector3{ 0.5f, 0.25f, 0.5f }, &materials[3]));
-    spheres.emplace_back(GenerateTangentSphere(spheres[0], Vector3{ 0.25f, 0.05f, -0.25f }, &materials[4]));
-    spheres.emplace_back(GenerateOffsetSphere(spheres[0], Vector3{ -0.25f, 1.0f, 1.5f }, 0.5f, &materials[5]));
-    spheres.emplace_back(GenerateTangentSphere(spheres[0], Vector3{ 0.25f, 0.1f, 0.25f }, &materials[6]));
-    spheres.emplace_back(GenerateTangentSphere(spheres[0], Vector3{ -0.65f, 0.05f, -0.25f }, &materials[7]));
+    double maxError = 0.0;
+    int mismatches = 0;
+    for (uint32_t bits = 0x00800000U; bits < 0x7f800000U - 4 * kStride; bits += 4 * kStride)
+    {
+        alignas(16) float values[4];
+        for (uint32_t lane = 0; lane < 4; ++lane)
+        {
+            const uint32_t laneBits = bits + lane * kStride;
+            memcpy(&values[lane], &laneBits, sizeof(float));
+        }
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, ReciprocalSqrtx4(_mm_load_ps(values)));
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            const float result = ReciprocalSqrt(values[lane]);
+            const double exact = 1.0 / sqrt(static_cast<double>(values[lane]));
+            maxError = std::max(maxError, fabs(result - exact) / exact);
+            mismatches += result != lanes[lane] ? 1 : 0;
+        }
+    }
+
+    Scene scene;
+    InitScene(scene);
+    Camera camera = DefaultCamera();
+    camera.Prepare(kImageSize, kImageSize);
+    double squaredDifference = 0.0;
+    for (int j = 0; j < kImageSize; ++j)
+    {
+        for (int i = 0; i < kImageSize; ++i)
+        {
+            const Ray ray = camera.GenerateRay(static_cast<float>(i) + 0.5f, static_cast<float>(j) + 0.5f);
+            const Vector3 direction = ray.direction * (0.5f + static_cast<float>(i + j) / kImageSize);
+            Ray exactRay = ray;
+            Ray fastRay = ray;
+            exactRay.direction = direction * (1.0f / direction.Length());
+            fastRay.direction = direction * ReciprocalSqrt(direction.Dot(direction));
+            // Both renders of a pixel draw the same random numbers
+            Random exactRandom(j * kImageSize + i + 1);
+            Random fastRandom(j * kImageSize + i + 1);
+            const Vector3 difference = TraceDirect(exactRay, scene, exactRandom) - TraceDirect(fastRay, scene, fastRandom);
+            squaredDifference += difference.Dot(difference);
+        }
+    }
+    const double imageRms = sqrt(squaredDifference / (3.0 * kImageSize * kImageSize));
+
+    std::vector<Vector3> vectors(kBatchSize);
+    alignas(16) float vectorX[kBatchSize];
+    alignas(16) float vectorY[kBatchSize];
+    alignas(16) float vectorZ[kBatchSize];
+    Random random(1);
+    for (int i = 0; i < kBatchSize; ++i)
+    {
+        vectors[i] = Vector3{ random.NextFloat() - 0.5f, random.NextFloat() - 0.5f, random.NextFloat() - 0.5f };
+        vectorX[i] = vectors[i].x;
+        vectorY[i] = vectors[i].y;
+        vectorZ[i] = vectors[i].z;
+    }
+
+    // Summing the results keeps the calls from being optimized away
+    Vector3 sum{ 0.0f };
+    const double exactTime = NanosecondsPerCall(kNumBatches, [&](int)
+    {
+        for (const Vector3& vector : vectors)
+        {
+            sum = sum + vector * (1.0f / vector.Length());
+        }
+    }) / kBatchSize;
+    const double fastTime = NanosecondsPerCall(kNumBatches, [&](int)
+    {
+        for (const Vector3& vector : vectors)
+        {
+            sum = sum + vector * ReciprocalSqrt(vector.Dot(vector));
+        }
+    }) / kBatchSize;
+    __m128 sum4 = _mm_setzero_ps();
+    auto normalizex4 = [&](auto invLength)
+    {
+        for (int i = 0; i < kBatchSize; i += 4)
+        {
+            const __m128 x = _mm_load_ps(vectorX + i);
+            const __m128 y = _mm_load_ps(vectorY + i);
+            const __m128 z = _mm_load_ps(vectorZ + i);
+            const __m128 scale = invLength(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+            sum4 = _mm_add_ps(sum4, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, scale), _mm_mul_ps(y, scale)), _mm_mul_ps(z, scale)));
+        }
+    };
+    const double exactTimex4 = NanosecondsPerCall(kNumBatches, [&](int)
+    {
+        normalizex4([](__m128 lengthSq) { return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(lengthSq)); });
+    }) / kBatchSize;
+    const double fastTimex4 = NanosecondsPerCall(kNumBatches, [&](int)
+    {
+        normalizex4([](__m128 lengthSq) { return ReciprocalSqrtx4(lengthSq); });
+    }) / kBatchSize;
+    volatile float sink = sum.x + sum.y + sum.z + _mm_cvtss_f32(sum4);
+    (void)sink;
+
+    const bool passed = maxError <= 4e-7 && mismatches == 0 && imageRms <= kMaxImageRms;
+    printf("rsqrt: max relative error %.1e, %d scalar/four-wide mismatches, image RMS difference %.1e, normalize %.2f ns "
+        "with sqrtf and %.2f ns with ReciprocalSqrt, four-wide %.2f ns with sqrt and %.2f ns with ReciprocalSqrtx4 -> %s\n",
+        maxError, mismatches, imageRms, exactTime, fastTime, exactTimex4, fastTimex4, passed ? "ok" : "FAILED");
+    return passed;
 }
 
-void Render(int width, int height, HDC hdc)
+// The default scene shrunk to millimeter detail and placed kDistance out, stored once in float world coordinates and
+// once relative to a scene origin there, traced with the camera moved along. Primary rays must hit the same spheres
+// as in the unmoved scene when it has its origin; the float world copy is reported for comparison. Also times the
+// sphere solve in float and double.
+bool SelfTestSceneOrigin()
 {
-    std::vector<Sphere> spheres;
-    std::vector<Material> materials;
+    const float kScale = 0.01f;
+    const Vector3d kDistance{ 4000.0, 0.0, 4000.0 };
+    const int kSize = 256;
+    const int kNumSolves = 1 << 22;
 
-    InitScene(spheres, materials);
+    Scene reference;
+    InitScene(reference);
+    for (Sphere& sphere : reference.spheres)
+    {
+        sphere.center = sphere.center * kScale;
+        sphere.radius *= kScale;
+    }
+    reference.bvh.Build(reference.spheres);
 
-    const Vector3 camTarget{ 0.0f, 0.0f, 0.0f };
-    const Vector3 camPos{ 0.0f, 0.5f, -1.0f };
-    const Vector3 camUp{ 0.0f, 1.0f, 0.0f };
-    const Vector3 camRight = camUp.Cross((camTarget - camPos).Normalize());
-    const Vector3 orthoCamUp = camRight.Cross(camPos.Normalize());
+    Scene world = reference;
+    Scene local = reference;
+    local.origin = kDistance;
+    for (size_t i = 0; i < reference.spheres.size(); ++i)
+    {
+        world.spheres[i].center = Vector3{ Vector3d{ reference.spheres[i].center } + kDistance };
+        local.spheres[i].center = ToSceneLocal(local, Vector3d{ reference.spheres[i].center } + kDistance);
+    }
+    world.bvh.Build(world.spheres);
+    local.bvh.Build(local.spheres);
 
-    const float dx = 2.0f / static_cast<float>(width);
-    const float dy = 2.0f / static_cast<float>(height);
+    const Camera defaultCamera = DefaultCamera();
+    const Vector3d position{ defaultCamera.position * kScale };
+    const Vector3d target{ defaultCamera.target * kScale };
+    Camera referenceCamera{ Vector3{ position }, Vector3{ target } };
+    Camera worldCamera{ Vector3{ position + kDistance }, Vector3{ target + kDistance } };
+    Camera localCamera{ ToSceneLocal(local, position + kDistance), ToSceneLocal(local, target + kDistance) };
+    referenceCamera.Prepare(kSize, kSize);
+    worldCamera.Prepare(kSize, kSize);
+    localCamera.Prepare(kSize, kSize);
 
-    for (int i = 0; i < width; ++i)
+    auto sphereHit = [](const Ray& ray, const Scene& scene)
+    {
+        Hit hit;
+        return IntersectScene(ray, scene, hit) ? hit.sphereIndex : -1;
+    };
+    int worldMismatches = 0;
+    int localMismatches = 0;
+    for (int j = 0; j < kSize; ++j)
     {
-        for (int j = 0; j < height; ++j)
+        for (int i = 0; i < kSize; ++i)
         {
-            Ray ray;
-            ray.origin = camPos;
+            const float x = static_cast<float>(i) + 0.5f;
+            const float y = static_cast<float>(j) + 0.5f;
+            const int expected = sphereHit(referenceCamera.GenerateRay(x, y), reference);
+            worldMismatches += sphereHit(worldCamera.GenerateRay(x, y), world) != expected ? 1 : 0;
+            localMismatches += sphereHit(localCamera.GenerateRay(x, y), local) != expected ? 1 : 0;
+        }
+    }
+
+    // The rays cycle through the spheres, so both precisions see the same mix of hits and misses
+    const int kNumRays = 4096;
+    std::vector<Ray> rays(kNumRays);
+    Random random(1);
+    for (Ray& ray : rays)
+    {
+        ray = referenceCamera.GenerateRay(random.NextFloat() * kSize, random.NextFloat() * kSize);
+    }
+    const int numSpheres = static_cast<int>(reference.spheres.size());
+    int numIntersections = 0;
+    const double floatTime = NanosecondsPerCall(kNumSolves, [&](int i)
+    {
+        std::array<Vector3, 2> intersection{};
+        numIntersections += Intersect<float>(rays[i % kNumRays], reference.spheres[i % numSpheres], intersection);
+    });
+    const double doubleTime = NanosecondsPerCall(kNumSolves, [&](int i)
+    {
+        std::array<Vector3, 2> intersection{};
+        numIntersections += Intersect<double>(rays[i % kNumRays], reference.spheres[i % numSpheres], intersection);
+    });
+    volatile int sink = numIntersections;
+    (void)sink;
 
-            Vector3 nearPlanePos;
-            nearPlanePos = camRight * (-1.0f + dx * static_cast<float>(i)) + orthoCamUp * (1.0f - dy * static_cast<float>(j));
-            ray.direction = (nearPlanePos - camPos).Normalize();
+    const bool passed = localMismatches == 0;
+    printf("scene origin: %.2f%% of primary rays change spheres in float world coordinates, %.2f%% with a scene origin, "
+        "sphere solve %.1f ns in float and %.1f ns in double -> %s\n", 100.0 * worldMismatches / (kSize * kSize),
+        100.0 * localMismatches / (kSize * kSize), floatTime, doubleTime, passed ? "ok" : "FAILED");
+    return passed;
+}
 
-            const int kNumSamples = 1024;
-            Vector3 colorSum{ 0.0f };
-            for (int s = 0; s < kNumSamples; ++s)
-            {
-                colorSum = colorSum + TracePath(ray, spheres, 0);
-            }
+// A random frame whose width is not a multiple of four through ConvertToYuv444 whole, which takes the SSE2 path for
+// all but the last few pixels, and one pixel at a time, which takes the scalar path for all of them; the Y, U and V
+// bytes must match. Then frames handed to a Y4mStreamWriter out of order must come out of the file in order.
+bool SelfTestYuv()
+{
+    const int kWidth = 37;
+    const int kHeight = 5;
+    const int kNumFrames = 3;
+    const int kWriteOrder[kNumFrames] = { 2, 0, 1 };
+    const int kFramesPerSecond = 30;
+    const char* kPath = "SoftPT_selftest.y4m";
+
+    const int numPixels = kWidth * kHeight;
+    Random random(1);
+    std::vector<Frame> frames(kNumFrames);
+    for (int i = 0; i < kNumFrames; ++i)
+    {
+        frames[i].index = i;
+        frames[i].width = kWidth;
+        frames[i].height = kHeight;
+        frames[i].pixels.resize(numPixels);
+        for (DWORD& pixel : frames[i].pixels)
+        {
+            pixel = random.NextUint() & 0x00ffffffU;
+        }
+    }
 
-            Vector3 color = colorSum * Vector3{ 1.0f / (float)kNumSamples };
+    std::vector<BYTE> simd(numPixels * 3);
+    std::vector<BYTE> scalar(numPixels * 3);
+    const DWORD* pixels = frames[0].pixels.data();
+    ConvertToYuv444(pixels, numPixels, simd.data(), simd.data() + numPixels, simd.data() + 2 * numPixels);
+    for (int i = 0; i < numPixels; ++i)
+    {
+        ConvertToYuv444(pixels + i, 1, scalar.data() + i, scalar.data() + numPixels + i, scalar.data() + 2 * numPixels + i);
+    }
+    int mismatches = 0;
+    for (size_t i = 0; i < simd.size(); ++i)
+    {
+        mismatches += simd[i] != scalar[i] ? 1 : 0;
+    }
 
-            COLORREF fragmentColor = RGB(static_cast<BYTE>(Saturate(color.x) * 255.0f), static_cast<BYTE>(Saturate(color.y) * 255.0f), static_cast<BYTE>(Saturate(color.z) * 255.0f));
-            SetPixel(hdc, i, j, fragmentColor);
+    // The file must hold the header and then every frame in index order
+    char header[64];
+    snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", kWidth, kHeight, kFramesPerSecond);
+    std::string expected = header;
+    for (const Frame& frame : frames)
+    {
+        std::vector<BYTE> planes(numPixels * 3);
+        ConvertToYuv444(frame.pixels.data(), numPixels, planes.data(), planes.data() + numPixels, planes.data() + 2 * numPixels);
+        expected += "FRAME\n";
+        expected.append(reinterpret_cast<const char*>(planes.data()), planes.size());
+    }
+    {
+        Y4mStreamWriter stream(kPath, kFramesPerSecond);
+        for (int index : kWriteOrder)
+        {
+            stream.Write(frames[index]);
+        }
+    }
+    std::string written;
+    FILE* file = fopen(kPath, "rb");
+    if (file != nullptr)
+    {
+        char buffer[4096];
+        size_t size;
+        while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        {
+            written.append(buffer, size);
         }
+        fclose(file);
+        remove(kPath);
     }
+    const bool inOrder = written == expected;
+
+    const bool passed = mismatches == 0 && inOrder;
+    printf("yuv: %d of %d bytes differ between the SSE2 and scalar paths, frames written %d %d %d come out %s -> %s\n",
+        mismatches, numPixels * 3, kWriteOrder[0], kWriteOrder[1], kWriteOrder[2], inOrder ? "in order" : "wrong",
+        passed ? "ok" : "FAILED");
+    return passed;
+}
+
+bool RunSelfTests()
+{
+    bool passed = true;
+    passed = SelfTestCancelLatency() && passed;
+    passed = SelfTestPreviewThroughput() && passed;
+    passed = SelfTestTemporalReuse() && passed;
+    passed = SelfTestRayOffsets() && passed;
+    passed = SelfTestMedia() && passed;
+    passed = SelfTestMotionBlurTraversal() && passed;
+    passed = SelfTestMaterialDispatch() && passed;
+    passed = SelfTestDielectric() && passed;
+    passed = SelfTestConductorFurnace() && passed;
+    passed = SelfTestPathGuiding() && passed;
+    passed = SelfTestBidirectional() && passed;
+    passed = SelfTestMetropolis() && passed;
+    passed = SelfTestLightTracing() && passed;
+    passed = SelfTestIrradianceCache() && passed;
+    passed = SelfTestRestir() && passed;
+    passed = SelfTestRandomLanes() && passed;
+    passed = SelfTestSinCos() && passed;
+    passed = SelfTestReciprocalSqrt() && passed;
+    passed = SelfTestSceneOrigin() && passed;
+    passed = SelfTestYuv() && passed;
+    printf("selftest %s\n", passed ? "passed" : "FAILED");
+    fflush(stdout);
+    return passed;
 }
 
 // Butchered win32 boilerplate appwizard code follows:
 HINSTANCE hInst;
+Renderer* renderer = nullptr;
+Camera camera = DefaultCamera();
+#if ANIMATE_CAMERA == 1
+RenderSettings renderSettings = AnimationRenderSettings();
+int animationFrame = 0;
+#else
+RenderSettings renderSettings;
+#endif//ANIMATE_CAMERA
+const UINT_PTR kPresentTimerId = 1;
 CHAR* szWindowClass = "SoftPT";
 
 // Forward declarations of functions included in this code module:
@@ -345,7 +6399,49 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
     _In_ int       nCmdShow)
 {
     UNREFERENCED_PARAMETER(hPrevInstance);
-    UNREFERENCED_PARAMETER(lpCmdLine);
+
+    // "--selftest" runs the built-in checks and benchmarks and exits with a nonzero code if any of them fails
+    if (wcsstr(lpCmdLine, L"--selftest") != nullptr)
+    {
+        return RunSelfTests() ? 0 : 1;
+    }
+
+    // "--sequence <frames> [pattern]" renders a camera orbit without opening a window, either to numbered PPM files or,
+    // for a pattern ending in ".y4m" or "-" (stdout), to a single YUV4MPEG2 stream
+    int numFrames = 0;
+    wchar_t widePattern[MAX_PATH] = L"frame_%04d.ppm";
+    if (swscanf(lpCmdLine, L" --sequence %d %259ls", &numFrames, widePattern) >= 1 && numFrames > 0)
+    {
+        char pattern[MAX_PATH];
+        WideCharToMultiByte(CP_ACP, 0, widePattern, -1, pattern, MAX_PATH, nullptr, nullptr);
+
+        const float kRadiansPerFrame = 0.01f;
+        const int kFramesPerSecond = 30;
+        SequenceSettings settings;
+        settings.numFrames = numFrames;
+
+        const size_t patternLength = strlen(pattern);
+        FrameWriter writer;
+        if (strcmp(pattern, "-") == 0 || (patternLength >= 4 && strcmp(pattern + patternLength - 4, ".y4m") == 0))
+        {
+            auto stream = std::make_shared<Y4mStreamWriter>(pattern, kFramesPerSecond);
+            if (!stream->IsOpen())
+            {
+                return 1;
+            }
+            writer = Y4mFrameWriter(stream);
+        }
+        else
+        {
+            writer = PpmSequenceWriter(pattern);
+        }
+
+        Renderer sequenceRenderer;
+        RenderSequence(sequenceRenderer, sequenceRenderer.DefaultScene(), settings,
+            [kRadiansPerFrame](int frame) { return OrbitCamera(kRadiansPerFrame * static_cast<float>(frame)); },
+            nullptr, writer);
+        return 0;
+    }
 
     // Initialize global strings
     MyRegisterClass(hInstance);
@@ -411,18 +6507,56 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 {
     switch (message)
     {
+    case WM_CREATE:
+        renderer = new Renderer;
+        SetTimer(hWnd, kPresentTimerId, 33, nullptr);
+        break;
+    case WM_SIZE:
+        if (wParam != SIZE_MINIMIZED)
+        {
+            renderer->Start(LOWORD(lParam), HIWORD(lParam), renderSettings, camera);
+        }
+        break;
+    case WM_KEYDOWN:
+        // 'P' toggles between the preview integrator and full path tracing
+        if (wParam == 'P')
+        {
+            bool preview = renderSettings.integrator != Integrator::Preview;
+            bool temporalReuse = renderSettings.temporalReuse;
+            renderSettings = preview ? PreviewRenderSettings() : RenderSettings{};
+            renderSettings.temporalReuse = temporalReuse;
+            RECT clientRect;
+            GetClientRect(hWnd, &clientRect);
+            renderer->Start(clientRect.right - clientRect.left, clientRect.bottom - clientRect.top, renderSettings, camera);
+        }
+        break;
+    case WM_TIMER:
+        #if ANIMATE_CAMERA == 1
+        if (renderer->IsIdle())
+        {
+            const float kRadiansPerFrame = 0.01f;
+            camera = OrbitCamera(kRadiansPerFrame * static_cast<float>(++animationFrame));
+            RECT clientRect;
+            GetClientRect(hWnd, &clientRect);
+            renderer->Start(clientRect.right - clientRect.left, clientRect.bottom - clientRect.top, renderSettings, camera);
+        }
+        #endif//ANIMATE_CAMERA
+        InvalidateRect(hWnd, nullptr, FALSE);
+        break;
+    case WM_ERASEBKGND:
+        return 1;
     case WM_PAINT:
     {
         PAINTSTRUCT ps;
         HDC hdc = BeginPaint(hWnd, &ps);
-        // TODO: Add any drawing code that uses hdc here...
-        RECT winRect;
-        GetWindowRect(hWnd, &winRect);
-        Render(winRect.right - winRect.left, winRect.bottom - winRect.top, hdc);
+        renderer->Present(hdc);
         EndPaint(hWnd, &ps);
     }
     break;
     case WM_DESTROY:
+        KillTimer(hWnd, kPresentTimerId);
+        delete renderer;
+        renderer = nullptr;
         PostQuitMessage(0);
         break;
     default: